@@ -2,6 +2,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <wdt.h>
+#include "ows_spm.h"
 
 int main()
 {
@@ -18,4 +19,10 @@ int main()
 	}
 }
 
+void ows_process_cmds()
+{
+	if(ows_recv() == 0xDA)
+		ows_spm();
+}
+
 
@@ -0,0 +1,133 @@
+/*
+ * Host-side throughput comparison of the CRC implementations.
+ * Every variant is the same source compiled with a different OW_CRC8_* or
+ * OW_CRC16_* option (see the crc_bench target in the Makefile).
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "ow_crc16.h"
+
+uint8_t ow_crc8_update_loop(uint8_t crc, uint8_t b);
+uint8_t ow_crc8_update_nibble(uint8_t crc, uint8_t b);
+uint8_t ow_crc8_update_table(uint8_t crc, uint8_t b);
+void ow_crc16_update_loop(ow_crc16_t* ctx, uint8_t b);
+void ow_crc16_update_nibble(ow_crc16_t* ctx, uint8_t b);
+void ow_crc16_update_table(ow_crc16_t* ctx, uint8_t b);
+
+#define BUF_SIZE 4096
+#define ROUNDS 4096
+
+static uint8_t buf[BUF_SIZE];
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const struct crc8_variant {
+	const char* name;
+	uint8_t (*update)(uint8_t crc, uint8_t b);
+} crc8_variants[] = {
+	{ "loop",   ow_crc8_update_loop },
+	{ "nibble", ow_crc8_update_nibble },
+	{ "table",  ow_crc8_update_table },
+};
+
+static const struct crc16_variant {
+	const char* name;
+	void (*update)(ow_crc16_t* ctx, uint8_t b);
+} crc16_variants[] = {
+	{ "loop",   ow_crc16_update_loop },
+	{ "nibble", ow_crc16_update_nibble },
+	{ "table",  ow_crc16_update_table },
+};
+
+static const char check[] = "123456789";
+
+static int bench_crc8()
+{
+	double base = 0;
+	int failed = 0;
+
+	printf("%-8s %10s %10s %8s\n", "crc8", "ns/byte", "MB/s", "speedup");
+	for(unsigned v = 0; v < sizeof(crc8_variants) / sizeof(crc8_variants[0]); ++v) {
+		const struct crc8_variant* var = &crc8_variants[v];
+		volatile uint8_t sink;
+		uint8_t crc = 0;
+		double t;
+
+		for(const char* p = check; *p; ++p)
+			crc = var->update(crc, *p);
+		if(crc != 0xA1) {
+			printf("%-8s check value 0x%02X, expected 0xA1\n", var->name, crc);
+			failed = 1;
+		}
+
+		t = now();
+		for(int r = 0; r < ROUNDS; ++r) {
+			crc = 0;
+			for(int i = 0; i < BUF_SIZE; ++i)
+				crc = var->update(crc, buf[i]);
+			sink = crc;
+		}
+		(void)sink;
+		t = (now() - t) * 1e9 / ((double)ROUNDS * BUF_SIZE);
+		if(!base)
+			base = t;
+		printf("%-8s %10.2f %10.1f %7.1fx\n", var->name, t, 1e3 / t, base / t);
+	}
+	return failed;
+}
+
+static int bench_crc16()
+{
+	double base = 0;
+	int failed = 0;
+
+	printf("%-8s %10s %10s %8s\n", "crc16", "ns/byte", "MB/s", "speedup");
+	for(unsigned v = 0; v < sizeof(crc16_variants) / sizeof(crc16_variants[0]); ++v) {
+		const struct crc16_variant* var = &crc16_variants[v];
+		volatile uint16_t sink;
+		ow_crc16_t crc = { 0 };
+		double t;
+
+		for(const char* p = check; *p; ++p)
+			var->update(&crc, *p);
+		if(crc.crc != 0xBB3D) {
+			printf("%-8s check value 0x%04X, expected 0xBB3D\n", var->name, crc.crc);
+			failed = 1;
+		}
+
+		t = now();
+		for(int r = 0; r < ROUNDS; ++r) {
+			crc.crc = 0;
+			for(int i = 0; i < BUF_SIZE; ++i)
+				var->update(&crc, buf[i]);
+			sink = crc.crc;
+		}
+		(void)sink;
+		t = (now() - t) * 1e9 / ((double)ROUNDS * BUF_SIZE);
+		if(!base)
+			base = t;
+		printf("%-8s %10.2f %10.1f %7.1fx\n", var->name, t, 1e3 / t, base / t);
+	}
+	return failed;
+}
+
+int main()
+{
+	int failed;
+
+	srand(1);
+	for(int i = 0; i < BUF_SIZE; ++i)
+		buf[i] = rand();
+
+	failed = bench_crc8();
+	failed |= bench_crc16();
+	return failed;
+}
@@ -3,8 +3,10 @@
 #include <avr/interrupt.h>
 #include <wdt.h>
 #include "debounce.h"
+#include "ow_crc8.h"
 #include <string.h> /* for memcpy */
 #include <avr/eeprom.h>
+#include "ows_eeprom.h"
 #ifdef OWS_SPM_ENABLE
 # include "ows_spm.h"
 #endif
@@ -23,6 +25,19 @@ static struct {
 	uint8_t int_type;
 	uint8_t padding[5];
 } config;
+#ifdef OWS_WEAR_LEVEL_ENABLE
+static struct ows_record config_store = OWS_RECORD(OWS_APP_STORE_BASE, E2END, sizeof(config));
+#endif
+
+/* config as last saved, from the fixed cells of older firmware if never */
+void config_load()
+{
+#ifdef OWS_WEAR_LEVEL_ENABLE
+	if(ows_record_load(&config_store, &config))
+		return;
+#endif
+	ows_eeprom_read(&config, 6, sizeof(config));
+}
 
 void pio_send_state()
 {
@@ -108,7 +123,7 @@ int main()
 	CLKPR = 0x00; /* Division Factor = 1, system clock 9.6MHz */
 #endif
 	ows_setup2(0x3A, 0);
-	eeprom_read_block(&config, (const void*)6, sizeof(config));
+	config_load();
 	PIO_PORT(PORT) = 0;
 
 #if 1
@@ -143,21 +158,36 @@ void ows_process_cmds()
 		break;
 	case 0x4E: /* Write Scratchpad */
 		{
-			char buf[sizeof(config) + 1];
-			ows_recv_data(buf, sizeof(buf));
-			if(buf[sizeof(config)] == ows_crc8(buf, sizeof(config)))
+			char buf[sizeof(config)];
+			uint8_t crc = 0;
+			for(uint8_t i = 0; i < sizeof(buf); ++i) {
+				buf[i] = ows_recv();
+				crc = ow_crc8_update(crc, buf[i]);
+			}
+			if(ows_recv() == crc)
 				memcpy(&config, buf, sizeof(config));
 		}
 		/* no break! */
 	case 0xBE: /* Read Scratchpad */
-		ows_send_data((char*)&config, 8);
-			ows_send(ows_crc8((char*)&config, 8));
+		{
+			uint8_t crc = 0;
+			for(uint8_t i = 0; i < sizeof(config); ++i) {
+				uint8_t b = ((uint8_t*)&config)[i];
+				ows_send(b);
+				crc = ow_crc8_update(crc, b);
+			}
+			ows_send(crc);
+		}
 		break;
 	case 0x48: /* Copy Scratchpad */
-		eeprom_write_block(&config, (void*)6, sizeof(config));
+#ifdef OWS_WEAR_LEVEL_ENABLE
+		ows_record_save(&config_store, &config);
+#else
+		ows_eeprom_write(6, &config, sizeof(config)); /* returns at once, EEPROM STATUS tells when it's done */
+#endif
 		break;
 	case 0xB8: /* Recall Scratchpad */
-		eeprom_read_block(&config, (const void*)6, sizeof(config));
+		config_load();
 		break;
 #ifdef OWS_SPM_ENABLE
 	case 0xDA:
@@ -186,7 +216,11 @@ void ows_process_interrupt()
 	int8_t h = config.int_mask >> 4;
 	int8_t il = ~config.int_mask & 0x0F;
 	if( ((il & h) | ~((s ^ h) | il)) & diff )
+#ifdef OWS_INTERRUPTS_ENABLE
 		ows_set_flag(OWS_FLAG_CONDSEARCH | (config.int_type & (OWS_FLAG_INT_TYPE1 | OWS_FLAG_INT_TYPE2)));
+#else /* conditional search only, e.g. with OWS_ASYNC_ENABLE */
+		ows_set_flag(OWS_FLAG_CONDSEARCH);
+#endif
 #endif
 }
 
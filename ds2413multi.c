@@ -0,0 +1,86 @@
+#include "ows.h"
+#include <avr/io.h>
+#include <wdt.h>
+
+/*
+ * Six DS2413 on one ATMega168 (OWS_MULTI_ENABLE): instance i has PIOA on
+ * PB(i) and PIOB on PC(i), Arduino nano pins D8..D13 and A0..A5.
+ */
+#define INSTANCES 6
+
+char myroms[INSTANCES][8] = {
+	{0x3A, 0x01, 0xDA, 0xBB, 0xCF, 0x00, 0x00},
+	{0x3A, 0x02, 0xDA, 0xBB, 0xCF, 0x00, 0x00},
+	{0x3A, 0x03, 0xDA, 0xBB, 0xCF, 0x00, 0x00},
+	{0x3A, 0x04, 0xDA, 0xBB, 0xCF, 0x00, 0x00},
+	{0x3A, 0x05, 0xDA, 0xBB, 0xCF, 0x00, 0x00},
+	{0x3A, 0x06, 0xDA, 0xBB, 0xCF, 0x00, 0x00},
+};
+
+/* what the bus shows when all selected instances answer: the AND of them */
+void pio_send_state()
+{
+	/* |  7    6    5    4 |  3    2    1    0  |
+	   |<complement of 3-0>|OutB PinB OutA PinA | */
+	uint8_t pina = PINB, pinb = PINC, outa = ~DDRB, outb = ~DDRC;
+	uint8_t sample = 0x0F;
+	for(uint8_t i = 0; i < INSTANCES; ++i)
+		if(ows_selected & (1 << i))
+			sample &= ((pina >> i) & 1) | (((outa >> i) & 1) << 1) | (((pinb >> i) & 1) << 2) | (((outb >> i) & 1) << 3);
+	sample |= (~sample << 4);
+	ows_send(sample);
+}
+
+void pio_read()
+{
+	while(! errno)
+		pio_send_state();
+}
+
+void pio_write()
+{
+	uint8_t data, cfm;
+	while(! errno)
+	{
+		data = ows_recv();
+		cfm = ~ows_recv();
+		if(cfm != data)
+			break;
+		/* output latch 0 pulls the pin low */
+		if(data & 0x01)
+			DDRB &= ~ows_selected;
+		else
+			DDRB |= ows_selected;
+		if(data & 0x02)
+			DDRC &= ~ows_selected;
+		else
+			DDRC |= ows_selected;
+		ows_send(0xAA);
+		pio_send_state();
+	}
+}
+
+int main()
+{
+	wdt_disable();
+	ows_setup_multi(myroms, INSTANCES);
+	PORTB &= ~((1 << INSTANCES) - 1);
+	PORTC &= ~((1 << INSTANCES) - 1);
+	for(;;)
+		ows_wait_request();
+}
+
+void ows_process_cmds()
+{
+	switch(ows_recv())
+	{
+	case 0xF5: /* PIO ACCESS READ */
+		pio_read();
+		break;
+	case 0x5A: /* PIO ACCESS WRITE */
+		pio_write();
+		break;
+	default:
+		break;
+	}
+}
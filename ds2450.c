@@ -1,24 +1,26 @@
 #include "ows.h"
 #include "ow_crc16.h"
+#include "ds2450_hal.h"
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <string.h>
 
 struct {
 	uint16_t conversion_readout[4]; // page 0
 	struct {
-		unsigned int rc:4; // number of bits, 0000 = 16
-		unsigned int : 2;
-		unsigned int oc:1; // output value
-		unsigned int oe:1; // output enable
-		unsigned int ir:1; // 0 - half max voltage, 1 - full max voltage
-		unsigned int : 1;
-		unsigned int ael:1; // alarm enable low
-		unsigned int aeh:1; // alarm enable high
-		unsigned int afl:1; // alarm flag low
-		unsigned int afh:1; // alarm flag high
-		unsigned int : 1;
-		unsigned int por:1; // just powered on
-	} control_status[4]; // page 1
+		uint16_t rc:4; // number of bits, 0000 = 16
+		uint16_t : 2;
+		uint16_t oc:1; // output value
+		uint16_t oe:1; // output enable
+		uint16_t ir:1; // 0 - half max voltage, 1 - full max voltage
+		uint16_t : 1;
+		uint16_t ael:1; // alarm enable low
+		uint16_t aeh:1; // alarm enable high
+		uint16_t afl:1; // alarm flag low
+		uint16_t afh:1; // alarm flag high
+		uint16_t : 1;
+		uint16_t por:1; // just powered on
+	} control_status[4]; // page 1, uint16_t keeps it 2 bytes on the host too
 	struct {
 		uint8_t low;
 		uint8_t high;
@@ -41,7 +43,195 @@ void init_memory()
 	memory.calibration[4] = 0x40;
 }
 
+/*
+ * READ MEMORY streams a snapshot of the 8 byte pages, each with its CRC16
+ * ready, so the bytes go out without any work in between. Whatever changes
+ * memory marks the pages; they are copied and summed up where the bus can
+ * wait: in the conversion status read, on waking up idle and after the
+ * presence pulse (ows_process_presence()), not at the end of a request,
+ * the core times the reset then. At overdrive there is no presence hook,
+ * a page changed since is sent from memory and summed up on the way, as
+ * the first page always is.
+ */
+#define PAGE_SIZE 8
+#define PAGES (sizeof(memory) / PAGE_SIZE)
 
+static struct {
+	uint8_t page[PAGES][PAGE_SIZE];
+	uint16_t crc[PAGES];
+} snapshot;
+static uint8_t dirty = (1 << PAGES) - 1; /* bit n: page n changed */
+
+static void snapshot_refresh()
+{
+	for(uint8_t p = 0; p < PAGES; ++p)
+		if(dirty & (1 << p)) {
+			ow_crc16_t crc;
+			memcpy(snapshot.page[p], (uint8_t*)&memory + p * PAGE_SIZE, PAGE_SIZE);
+			ow_crc16_reset(&crc);
+			for(uint8_t i = 0; i < PAGE_SIZE; ++i)
+				ow_crc16_update(&crc, snapshot.page[p][i]);
+			snapshot.crc[p] = ow_crc16_get(&crc);
+		}
+	dirty = 0;
+}
+
+/*
+ * CONVERT runs the selected channels one after the other, A first. Beyond
+ * the 10 bits of the ADC a channel takes 4^(rc-10) samples, their sum
+ * shifted right by rc-10 (oversampling and decimation, 16 bits: 4096
+ * samples, 0.43S at 16MHz). The result goes to page 0 left aligned, the low
+ * bits beyond rc zero. There's no 2.56V reference, the half range (ir = 0)
+ * doubles the reading. A result beyond an enabled limit latches the
+ * channel's alarm flag, only the master clears it, writing the
+ * control/status page.
+ *
+ * The ADC complete interrupt gets in whenever the bus is idle at standard
+ * speed: built with OWS_IDLE_IRQ_ENABLE the core waits for the time slots
+ * with interrupts on, so it has to stay a few uS short (with
+ * OWS_ASYNC_ENABLE they always are on, the bus interrupts come first). It
+ * only adds the sample to the channel's sum and goes on with the next
+ * channel adc_convert() planned; storing the results, the alarm flags and
+ * the snapshot wait for adc_poll(), where the bus can wait too: a
+ * channel finished while the core waits for a ROM command shows up in
+ * READ MEMORY after the next reset, so the master waits the conversion
+ * time before the reset it reads with. At overdrive the core polls the
+ * slots with interrupts off, they only get in while it waits for a reset:
+ * after CONVERT the master resets and sends a ROM command that selects no
+ * one (00), then keeps the bus idle for the conversion time and the core's
+ * idle timeout (65536 polls, ~30mS at 16MHz) that has ows_process_interrupt()
+ * store the results, resets and reads. The conversion status read takes a
+ * sample a byte instead, 4096 of them for 16 bits.
+ */
+static volatile struct {
+	uint8_t select; /* not stored yet, bit 0 = A */
+	uint8_t done; /* converted, for adc_poll() to store */
+	uint8_t channel; /* converting, 4: none */
+	uint8_t discard; /* the running conversion isn't ours */
+	uint16_t left; /* samples of the channel still to take */
+	uint8_t bits[4];
+	uint16_t samples[4]; /* 0: not selected */
+	uint32_t sum[4];
+} adc;
+
+/*
+ * CONDITIONAL SEARCH finds us while an enabled alarm flag is set, or the
+ * power on reset flag (not configured yet) as the DS2450 does. Selecting
+ * the device clears the core's flag, every request sets it again.
+ */
+static void alarm_update()
+{
+	uint8_t f = 0;
+	for(uint8_t c = 0; c < 4; ++c) {
+		if((memory.control_status[c].aeh && memory.control_status[c].afh)
+				|| (memory.control_status[c].ael && memory.control_status[c].afl)
+				|| memory.control_status[c].por)
+			f = OWS_FLAG_CONDSEARCH;
+	}
+	ows_set_flag(f);
+}
+
+static void adc_store(uint8_t c)
+{
+	uint8_t bits = adc.bits[c], k = bits > 10 ? bits - 10 : 0;
+	uint16_t v = (uint16_t)(adc.sum[c] >> k) << (6 - k);
+	if(!memory.control_status[c].ir)
+		v = v & 0x8000 ? 0xFFFF : v << 1;
+	if(bits < 16)
+		v &= 0xFFFF << (16 - bits);
+	memory.conversion_readout[c] = v;
+	/* the limits compare the most significant byte */
+	if(memory.control_status[c].aeh && v >> 8 > memory.alarm_settings[c].high)
+		memory.control_status[c].afh = 1;
+	if(memory.control_status[c].ael && v >> 8 < memory.alarm_settings[c].low)
+		memory.control_status[c].afl = 1;
+	dirty |= 0x03; /* the result, the alarm flags */
+	adc.select &= ~(1 << c);
+}
+
+static void adc_sample()
+{
+	uint16_t s = ds2450_hal_adc_read();
+	if(adc.discard)
+		adc.discard = 0;
+	else if(adc.left) {
+		adc.sum[adc.channel] += s;
+		if(--adc.left == 0) {
+			adc.done |= 1 << adc.channel;
+			while(++adc.channel < 4 && !(adc.left = adc.samples[adc.channel]))
+				;
+		}
+	}
+	if(adc.left)
+		ds2450_hal_adc_start(adc.channel);
+}
+
+ISR(ADC_vect, ISR_NOBLOCK)
+{
+	adc_sample();
+}
+
+/*
+ * What the interrupt leaves: a result it hasn't had yet, the channels it
+ * finished, the snapshot of the pages that changed.
+ */
+static void adc_poll()
+{
+	uint8_t d;
+	ds2450_hal_adc_irq_disable();
+	if(ds2450_hal_adc_done()) {
+		ds2450_hal_adc_clear();
+		adc_sample();
+	}
+	d = adc.done;
+	adc.done = 0;
+	ds2450_hal_adc_irq_enable();
+	if(d) {
+		for(uint8_t c = 0; c < 4; ++c)
+			if(d & (1 << c))
+				adc_store(c);
+		alarm_update();
+	}
+	if(dirty)
+		snapshot_refresh();
+}
+
+/* input select, readout control: presets, then the plan for the interrupt */
+static void adc_convert(uint8_t select, uint8_t readout)
+{
+	adc_poll(); /* what is left of the previous CONVERT */
+	select &= 0x0F;
+	ds2450_hal_adc_irq_disable();
+	adc.channel = 4;
+	adc.left = 0;
+	for(uint8_t c = 4; c-- > 0; ) {
+		uint8_t bits = memory.control_status[c].rc;
+		adc.samples[c] = 0;
+		if(!(select & (1 << c)))
+			continue;
+		if(((readout >> 2 * c) & 3) == 1)
+			memory.conversion_readout[c] = 0x0000;
+		else if(((readout >> 2 * c) & 3) == 2)
+			memory.conversion_readout[c] = 0xFFFF;
+		dirty |= 0x01;
+		if(!bits)
+			bits = 16;
+		adc.bits[c] = bits;
+		adc.samples[c] = bits > 10 ? 1 << 2 * (bits - 10) : 1;
+		adc.sum[c] = 0;
+		adc.channel = c;
+	}
+	adc.select = select;
+	adc.done = 0;
+	/* a conversion left from the previous CONVERT completes first */
+	adc.discard = ds2450_hal_adc_busy() || ds2450_hal_adc_done();
+	if(select) {
+		adc.left = adc.samples[adc.channel];
+		if(!adc.discard)
+			ds2450_hal_adc_start(adc.channel);
+	}
+	ds2450_hal_adc_irq_enable();
+}
 
 
 char myrom[8] = {0x20, 0xBB, 0xAD, 0xCD, 0x0A, 0x00, 0x00, 0x00};
@@ -50,86 +240,137 @@ char myrom[8] = {0x20, 0xBB, 0xAD, 0xCD, 0x0A, 0x00, 0x00, 0x00};
 int main()
 {
 	init_memory();
+	ds2450_hal_adc_setup();
 	ows_setup(myrom);
-	for(;;)
+	alarm_update();
+	snapshot_refresh();
+	for(;;) {
 		ows_wait_request();
+#ifdef OWS_ASYNC_ENABLE
+		adc_poll(); /* a request ended, the interrupts answer the reset */
+#endif
+	}
+}
+
+/* woken up without a request: a sample may be waiting */
+void ows_process_interrupt()
+{
+	adc_poll();
 }
 
+#ifndef OWS_ASYNC_ENABLE
+/* the master's ROM command is 330uS away: channels finished, WRITE MEMORY */
+void ows_process_presence()
+{
+	adc_poll();
+}
+#endif
+
 void ows_process_cmds()
 {
 	uint16_t memory_address;
-	uint8_t b;
-	ow_crc16_reset();
+	uint8_t b, select, first = 1;
+	ow_crc16_t crc;
+	ow_crc16_reset(&crc);
+	alarm_update();
 	switch(ows_recv())
 	{
 	case 0xAA: /* READ MEMORY */
-		ow_crc16_update(0xAA);
+		ow_crc16_update(&crc, 0xAA);
 
 		b = ows_recv();
 		((uint8_t*)&memory_address)[0] = b;
-		ow_crc16_update(b);
+		ow_crc16_update(&crc, b);
 
 		b = ows_recv();
 		((uint8_t*)&memory_address)[1] = b;
-		ow_crc16_update(b);
+		ow_crc16_update(&crc, b);
 
-		for(;;)
+		/* only the first page's CRC covers the command and address too */
+		for(; memory_address < sizeof(memory); ++memory_address)
 		{
-			uint8_t b = ((uint8_t*)&memory)[memory_address];
+			uint8_t p = memory_address / PAGE_SIZE;
+			uint8_t live = first || (dirty & (1 << p)); /* summed up here */
+			b = dirty & (1 << p) ? ((uint8_t*)&memory)[memory_address]
+				: snapshot.page[p][memory_address % PAGE_SIZE];
 			ows_send(b);
-			ow_crc16_update(b);
-
 			if(errno)
 				break;
+			if(live)
+				ow_crc16_update(&crc, b);
 
-			if((memory_address & 0x0F) == 0x0F) /* end of page */
+			if(memory_address % PAGE_SIZE == PAGE_SIZE - 1) /* end of page */
 			{
-				uint16_t crc = ow_crc16_get();
-				ows_send(((uint8_t*)&crc)[0]);
-				ows_send(((uint8_t*)&crc)[1]);
-				ow_crc16_reset();
+				uint16_t c = live ? ow_crc16_get(&crc) : snapshot.crc[p];
+				ows_send(((uint8_t*)&c)[0]);
+				ows_send(((uint8_t*)&c)[1]);
+				first = 0;
+				ow_crc16_reset(&crc);
 			}
-			++memory_address;
-			if(memory_address >= sizeof(memory))
-				while(! errno)
-					ows_send(0xFF);
 		}
+		while(! errno)
+			ows_send(0xFF);
 		break;
 	case 0x55: /* WRITE MEMORY */
-		ow_crc16_update(0x55);
+		ow_crc16_update(&crc, 0x55);
 
 		b = ows_recv();
 		((uint8_t*)&memory_address)[0] = b;
-		ow_crc16_update(b);
+		ow_crc16_update(&crc, b);
 
 		b = ows_recv();
 		((uint8_t*)&memory_address)[1] = b;
-		ow_crc16_update(b);
+		ow_crc16_update(&crc, b);
 
 		for(;;)
 		{
 			b = ows_recv();
 			if(errno)
 				break;
-			ow_crc16_update(b);
-			uint16_t crc = ow_crc16_get();
-			ows_send(((uint8_t*)&crc)[0]);
-			ows_send(((uint8_t*)&crc)[1]);
+			ow_crc16_update(&crc, b);
+			uint16_t c = ow_crc16_get(&crc);
+			ows_send(((uint8_t*)&c)[0]);
+			ows_send(((uint8_t*)&c)[1]);
 
-			((uint8_t*)&memory)[memory_address] = b;
+			if(memory_address < sizeof(memory)) {
+				((uint8_t*)&memory)[memory_address] = b;
+				dirty |= 1 << memory_address / PAGE_SIZE;
+			}
+			alarm_update();
 
 			ows_send(b);
 			if(errno)
 				break;
 
 			++memory_address;
-			ow_crc16_reset();
-			ow_crc16_update(((uint8_t*)&memory_address)[0]);
-			ow_crc16_update(((uint8_t*)&memory_address)[1]);
+			ow_crc16_reset(&crc);
+			ow_crc16_update(&crc, ((uint8_t*)&memory_address)[0]);
+			ow_crc16_update(&crc, ((uint8_t*)&memory_address)[1]);
 		}
 
 		break;
 	case 0x3C: /* CONVERT */
+		ow_crc16_update(&crc, 0x3C);
+
+		select = ows_recv(); /* input select mask */
+		ow_crc16_update(&crc, select);
+
+		b = ows_recv(); /* readout control */
+		ow_crc16_update(&crc, b);
+
+		{
+			uint16_t c = ow_crc16_get(&crc);
+			ows_send(((uint8_t*)&c)[0]);
+			ows_send(((uint8_t*)&c)[1]);
+		}
+		if(errno)
+			break;
+		adc_convert(select, b);
+		/* zeros while converting, then ones, a byte late */
+		do {
+			adc_poll();
+			ows_send(adc.select ? 0x00 : 0xFF);
+		} while(! errno);
 		break;
 	default:
 		break;
@@ -0,0 +1,91 @@
+#ifndef DS2450_HAL_H_INCLUDED
+#define DS2450_HAL_H_INCLUDED
+
+/*
+ * What the ds2450 needs on top of ows_hal.h: the ADC, channels A..D on
+ * ADC0..ADC3 (PC0..PC3), AVcc as the reference. Single conversions, the
+ * next one started from the ADC complete interrupt or after polling for
+ * its flag. ATMega168 only; with OWS_HOST the ADC is simulated in
+ * host/ows_host.c.
+ */
+
+#include "ows_hal.h"
+
+#ifndef OWS_HOST
+
+/* 50..200kHz for the full 10 bits: 13 clocks a conversion */
+#if CLK_FREQ > 12800
+# define DS2450_ADC_PRESCALER (7<<ADPS0) /* clk/128 */
+#else
+# define DS2450_ADC_PRESCALER (6<<ADPS0) /* clk/64 */
+#endif
+
+/* enabled, interrupt off */
+static inline void ds2450_hal_adc_setup()
+{
+    PRR &= ~(1 << PRADC);
+    DIDR0 = 0x0F; /* no digital input buffers on the channels */
+    ADMUX = 1<<REFS0;
+    ADCSRA = 1<<ADEN | DS2450_ADC_PRESCALER;
+}
+
+/*
+ * ADIF is cleared by writing it 1: the read-modify-writes below must not
+ * write back a result still waiting.
+ */
+static inline void ds2450_hal_adc_start(uint8_t channel)
+{
+    ADMUX = 1<<REFS0 | channel;
+    ADCSRA = (ADCSRA & ~(1<<ADIF)) | 1<<ADSC;
+}
+
+/* a conversion is running */
+static inline uint8_t ds2450_hal_adc_busy()
+{
+    return ADCSRA & (1<<ADSC);
+}
+
+/* a result is waiting, the interrupt clears it when it is served */
+static inline uint8_t ds2450_hal_adc_done()
+{
+    return ADCSRA & (1<<ADIF);
+}
+
+static inline void ds2450_hal_adc_clear()
+{
+    ADCSRA |= 1<<ADIF;
+}
+
+static inline uint16_t ds2450_hal_adc_read()
+{
+    return ADC;
+}
+
+static inline void ds2450_hal_adc_irq_enable()
+{
+    ADCSRA = (ADCSRA & ~(1<<ADIF)) | 1<<ADIE;
+}
+
+static inline void ds2450_hal_adc_irq_disable()
+{
+    ADCSRA &= ~(1<<ADIF | 1<<ADIE);
+}
+
+#else /* OWS_HOST */
+
+void ds2450_hal_adc_setup();
+void ds2450_hal_adc_start(uint8_t channel);
+uint8_t ds2450_hal_adc_busy();
+uint8_t ds2450_hal_adc_done();
+void ds2450_hal_adc_clear();
+uint16_t ds2450_hal_adc_read();
+void ds2450_hal_adc_irq_enable();
+void ds2450_hal_adc_irq_disable();
+
+#endif /* OWS_HOST */
+
+#endif /* DS2450_HAL_H_INCLUDED */
+
+/*
+ vim: ts=4 sw=4 sts=4 et
+*/
@@ -1,46 +1,109 @@
 #include <avr/io.h>
 #include "ows.h"
+#include "ds2480_hal.h"
+#include "ow_crc8.h"
+#include <avr/interrupt.h>
 
-void serial_init()
+#define FOSC CLK_FREQ * 1000 // Clock Speed
+#define UBRR_2X(baud) ((FOSC / 4 / (baud) + 1) / 2 - 1) /* rounded, double speed */
+
+/* RBR parameter values: 2.1% off at 115200, the others within 1% */
+static const uint16_t serial_ubrr[4] = {
+	UBRR_2X(9600), UBRR_2X(19200), UBRR_2X(57600), UBRR_2X(115200)
+};
+
+/*
+ * Both directions go through rings served by the USART interrupts, so
+ * the next command bytes are taken in while bus_send_byte() runs its
+ * slots and the replies drain meanwhile. The PC may stream data mode
+ * bytes back to back, up to SERIAL_RX_LEN ahead of the bus.
+ */
+#define SERIAL_RX_LEN 256 /* power of 2, a batch script and then some */
+#define SERIAL_TX_LEN 32 /* power of 2 */
+static volatile uint8_t serial_rx[SERIAL_RX_LEN], serial_tx[SERIAL_TX_LEN];
+static volatile uint8_t rx_head, rx_tail, tx_head, tx_tail;
+static volatile uint8_t serial_break; /* framing error seen */
+static volatile uint8_t serial_sent; /* since the rate was set */
+static volatile uint8_t pulse_ended; /* the strong pull-up timed out */
+#define SERIAL_BREAK 0x100 /* serial_read_wait(): the PC sent a break */
+#define SERIAL_PULSE_END 0x200 /* ... or the pulse ended, its reply is due */
+
+ISR(USART_RX_vect)
 {
-	/* PRUSART0 must be disabled by writing a logical zero */
-	PRR &= ~(1 << PRUSART0);
+	uint8_t fe = ds2480_hal_uart_rx_error(); /* before the data is read */
+	uint8_t c = ds2480_hal_uart_read();
+	uint8_t next = (rx_tail + 1) & (SERIAL_RX_LEN - 1);
+	if(fe)
+		serial_break = 1;
+	else if(next != rx_head) { /* a full ring drops it, like an overrun */
+		serial_rx[rx_tail] = c;
+		rx_tail = next;
+	}
+}
 
-#define FOSC CLK_FREQ * 1000 // Clock Speed
-#define BAUD 9600
-#define MYUBRR (FOSC/16/BAUD-1)
-	/*Set baud rate */
-	UBRR0H = (unsigned char)(MYUBRR>>8);
-	UBRR0L = (unsigned char)MYUBRR;
-	/* Enable receiver and transmitter */
-	UCSR0B = (1<<RXEN0)|(1<<TXEN0);
-	/* Set frame format: 8data, 1stop bit */
-	UCSR0C = (3<<UCSZ00);
+ISR(USART_UDRE_vect)
+{
+	if(tx_head == tx_tail) {
+		ds2480_hal_uart_tx_irq_disable();
+		return;
+	}
+	ds2480_hal_uart_write(serial_tx[tx_head]);
+	tx_head = (tx_head + 1) & (SERIAL_TX_LEN - 1);
+	serial_sent = 1;
 }
 
-char serial_read_wait()
+/* a byte, SERIAL_BREAK for a break or any other framing error, or SERIAL_PULSE_END */
+int serial_read_wait()
 {
+	uint8_t c;
 	/* Wait for data to be received */
-	while ( !(UCSR0A & (1<<RXC0)) );
-	if(UCSR0A & (1 << FE0))
-		__asm__ __volatile__("rjmp __vectors"); /* reset! */
+	cli();
+	while(rx_head == rx_tail && !serial_break && !pulse_ended) {
+		sei(); /* sleeps before a pending interrupt is served */
+		ds2480_hal_idle();
+		cli();
+	}
+	sei();
+	if(serial_break) {
+		serial_break = 0;
+		return SERIAL_BREAK;
+	}
+	if(pulse_ended)
+		return SERIAL_PULSE_END;
 
-	return UDR0;
+	c = serial_rx[rx_head];
+	rx_head = (rx_head + 1) & (SERIAL_RX_LEN - 1);
+	return c;
 }
 
 void serial_write(char c)
 {
-	/* Wait for empty transmit buffer */
-	while ( !( UCSR0A & (1<<UDRE0)) );
-	/* Put data into buffer, sends the data */
-	UDR0 = c;
+	uint8_t next = (tx_tail + 1) & (SERIAL_TX_LEN - 1);
+	/* Wait for room in the ring, the UDRE interrupt is on while it's full */
+	while(next == tx_head)
+		ds2480_hal_idle();
+	serial_tx[tx_tail] = c;
+	tx_tail = next;
+	ds2480_hal_uart_tx_irq_enable();
 }
 
 void serial_flushrx()
 {
-	unsigned char dummy;
-	while ( UCSR0A & (1<<RXC0) )
-		dummy = UDR0;
+	cli();
+	rx_head = rx_tail;
+	sei();
+}
+
+/* after what is queued has gone out at the old rate, as the DS2480B does */
+void serial_set_rate(uint8_t rbr)
+{
+	while(tx_head != tx_tail)
+		ds2480_hal_idle(); /* the UDRE interrupt is on meanwhile */
+	if(serial_sent)
+		while(!ds2480_hal_uart_tx_idle())
+			;
+	serial_sent = 0;
+	ds2480_hal_uart_setup(serial_ubrr[rbr]);
 }
 /*
 	reset 1wire bus
@@ -51,31 +114,42 @@ void serial_flushrx()
 /* ================= 1-wire bus low-level functions ========== */
 #define uS(usec) ((usec##L) * CLK_FREQ) / 4L / 1000L
 
-void wait(uint16_t delay)
-{
-    delay -= 2; // account for the time taken in the preceeding commands.
+/* slot times: timer 1 ticks or wait() loops */
+#ifdef DS2480_TIMER1_ENABLE
+# define SLOT_CLK 1
+#else
+# define SLOT_CLK 4
+#endif
+#define uT(usec) ((uint16_t)(usec) * (uint16_t)(CLK_FREQ / SLOT_CLK / 1000))
 
-    // busy wait
-    __asm__ __volatile__ (
-        "1: sbiw %0,1" "\n\t" // 2 cycles
-        "brne 1b" : "=w" (delay) : "0" (delay) // 2 cycles
-    );
+/*
+ * Inlined, so a wait is the loop and nothing else: 4 clocks per count,
+ * 0.25uS at 16MHz. The times around it are a few single cycle port
+ * instructions, which keeps a 1uS overdrive write-1 at about 1uS.
+ */
+static inline void wait(uint16_t delay)
+{
+    ows_hal_delay4(delay); // busy wait
 }
 
 
-inline void bus_pull_down()
+static inline void bus_pull_down()
 {
-	OWPORT(DDR) |= (OWMASK);    // drives output low
+	ows_pull_bus_down();    // drives output low
 }
 
-inline void bus_release()
+static inline void bus_release()
 {
-	OWPORT(DDR) &= ~(OWMASK);
+	ows_release_bus();
 }
 
-inline uint8_t bus_read()
+static inline uint8_t bus_read()
 {
-	return (OWPORT(PIN) & OWMASK) ? 1 : 0;
+#ifdef DS2480_TIMER1_ENABLE
+	return ds2480_hal_bus_read();
+#else
+	return ows_read_bus();
+#endif
 }
 
 struct timing_t {
@@ -83,7 +157,7 @@ struct timing_t {
 	uint16_t tRSTL; /* reset low time */
 	uint16_t tSI; /* interrupt test delay */
 	uint16_t tPDT; /* presence detection delay */
-	uint16_t rFILL; /* response wait */
+	uint16_t rFILL; /* high time after the reset pulse, presence included */
 	/* Write-1 */
 	uint16_t tLOW1; /* write-1 low length */
 	uint16_t tDSO; /* write-1 sampling offset */
@@ -92,15 +166,20 @@ struct timing_t {
 	uint16_t tLOW0; /* write-0 low length */
 	uint16_t tREC0; /* write-0 recovery time */
 };
-struct timing_t timings_standard  = { /* Standard/Flexible */
-	uS(512), uS(8), uS(64), uS(512),  /* reset sequence: 584 uS total */
-	uS(8), uS(3), uS(49),             /* timeslot: 60uS total */
-	uS(57), uS(3),                    /* timeslot: 60uS total */
+struct timing_t timings_standard  = { /* Standard */
+	uT(512), uT(8), uT(64), uT(512),  /* reset sequence: 1024 uS total */
+	uT(8), uT(3), uT(49),             /* timeslot: 60uS total */
+	uT(57), uT(3),                    /* timeslot: 60uS total */
+};
+struct timing_t timings_flexible  = { /* Flexible, power up values */
+	uT(512), uT(8), uT(64), uT(512),  /* reset sequence: 1024 uS total */
+	uT(8), uT(3), uT(49),             /* timeslot: 60uS total */
+	uT(57), uT(3),                    /* timeslot: 60uS total */
 };
 struct timing_t timings_overdrive = { /* Overdrive */
-	uS(64),  uS(2), uS(8),  uS(64),   /* reset sequence: 74 uS total */
-	uS(1), uS(1), uS(8),              /* timeslot: 10uS total */
-	uS(7), uS(3),                     /* timeslot: 10uS total */
+	uT(64),  uT(2), uT(8),  uT(64),   /* reset sequence: 128 uS total */
+	uT(1), uT(1), uT(8),              /* timeslot: 10uS total */
+	uT(7), uT(3),                     /* timeslot: 10uS total */
 };
 struct timing_t* timings = &timings_standard;
 uint8_t search_accelerator_enabled = 0;
@@ -112,6 +191,61 @@ enum reset_result_t {
 	RESET_NOONE = 0x03,
 };
 
+#ifdef DS2480_TIMER1_ENABLE
+/*
+ * The edges of a slot come from timer 1 (ds2480_hal.h), interrupts are
+ * only off while the release is scheduled. An ISR can delay the polling
+ * here, not the edges, and a read goes by the captured time of the
+ * rising edge rather than by when the pin is looked at.
+ */
+static inline uint16_t bus_slot(uint16_t low, uint8_t rising)
+{
+	uint16_t t0;
+	cli();
+	t0 = ds2480_hal_slot_start(low, rising);
+	sei();
+	return t0;
+}
+
+static inline void bus_slot_wait(uint16_t t0, uint16_t t)
+{
+	while((uint16_t)(ds2480_hal_timer_read() - t0) < t)
+		;
+}
+
+enum reset_result_t bus_reset()
+{
+	const struct timing_t *t = timings;
+	uint16_t t0 = bus_slot(t->tRSTL, 0), edge; /* presence: the next falling edge */
+	enum reset_result_t r;
+	bus_slot_wait(t0, t->tRSTL + t->tSI);
+	if(bus_read()) { /* normal */
+		bus_slot_wait(t0, t->tRSTL + t->tSI + t->tPDT);
+		r = ds2480_hal_capture(&edge) ? RESET_PRESENCE : RESET_NOONE;
+		bus_slot_wait(t0, t->tRSTL + t->rFILL); /* the presence pulse is over */
+		return r;
+	} else { /* interrupt or short circuit */
+		wait(uS(4096));
+		return bus_read() ? RESET_ALARM : RESET_SHORTED;
+	}
+}
+uint8_t bus_send_bit(uint8_t b)
+{
+	const struct timing_t *t = timings;
+	uint16_t t0, edge;
+	if(b) {
+		uint16_t sample = t->tLOW1 + t->tDSO;
+		t0 = bus_slot(t->tLOW1, 1);
+		bus_slot_wait(t0, sample);
+		b = ds2480_hal_capture(&edge) && (uint16_t)(edge - t0) <= sample;
+		bus_slot_wait(t0, sample + t->tHIGH1);
+	} else {
+		t0 = bus_slot(t->tLOW0, 1);
+		bus_slot_wait(t0, t->tLOW0 + t->tREC0);
+	}
+	return b;
+}
+#else /* DS2480_TIMER1_ENABLE */
 enum reset_result_t bus_reset()
 {
 	bus_pull_down();
@@ -119,8 +253,11 @@ enum reset_result_t bus_reset()
 	bus_release();
 	wait(timings->tSI);
 	if(bus_read()) { /* normal */
+		enum reset_result_t r;
 		wait(timings->tPDT);
-		return bus_read() ? RESET_NOONE : RESET_PRESENCE;
+		r = bus_read() ? RESET_NOONE : RESET_PRESENCE;
+		wait(timings->rFILL - timings->tSI - timings->tPDT); /* the presence pulse is over */
+		return r;
 	} else { /* interrupt or short circuit */
 		wait(uS(4096));
 		return bus_read() ? RESET_ALARM : RESET_SHORTED;
@@ -128,18 +265,33 @@ enum reset_result_t bus_reset()
 }
 uint8_t bus_send_bit(uint8_t b)
 {
+	const struct timing_t *t = timings;
 	uint8_t r = b ? 1 : 0;
-	bus_pull_down();
 	if(b) {
-		wait(timings->tLOW1);
+		uint16_t low = t->tLOW1, dso = t->tDSO; /* loaded before the slot starts */
+		cli(); /* an interrupt here would stretch the low time or the sampling */
+		bus_pull_down();
+		wait(low);
 		bus_release();
-		wait(timings->tDSO);
+		wait(dso);
 		r = bus_read();
-		wait(timings->tHIGH1);
+		sei();
+		wait(t->tHIGH1);
 	} else {
-		wait(timings->tLOW0);
+		bus_pull_down(); /* a few uS more don't matter here */
+		wait(t->tLOW0);
 		bus_release();
-		wait(timings->tREC0);
+		wait(t->tREC0);
+	}
+	return r;
+}
+#endif /* DS2480_TIMER1_ENABLE */
+char bus_send_byte_plain(char c)
+{
+	char r = 0;
+	for(uint8_t i = 0; i < 8; ++i) {
+		r |= bus_send_bit(c & 0x01) << i;
+		c >>= 1;
 	}
 	return r;
 }
@@ -160,16 +312,281 @@ char bus_send_byte(char c)
 			r |= d << i;
 		}
 	} else { /*normal send byte */
-		for(uint8_t i = 0; i < 8; ++i) {
-			r |= bus_send_bit(c & 0x01) << i;
-			c >>= 1;
+		r = bus_send_byte_plain(c);
+	}
+	return r;
+}
+
+/*
+ * Vendor extension: the whole search on the adapter. In command mode
+ * 0xF0 enumerates the bus with SEARCH ROM, 0xEC with ALARM SEARCH, at the
+ * current speed. The reply streams while the search goes on: 0x01 and
+ * the 8 ROM bytes (as on the bus, family first) for every device, then
+ * SEARCH_DONE, or SEARCH_FAILED when a pass kept going wrong (bad CRC,
+ * devices leaving the bus, no presence). A pass that fails is repeated
+ * up to SEARCH_RETRIES times.
+ */
+#define SEARCH_FOUND 0x01
+#define SEARCH_DONE 0x00
+#define SEARCH_FAILED 0xFF
+#define SEARCH_RETRIES 3
+
+void bus_search(uint8_t cmd)
+{
+	uint8_t rom[8], last = 0; /* last zero fork, 1 based */
+	uint8_t found = 0, tries = 0;
+	while(tries < SEARCH_RETRIES) {
+		uint8_t fork = 0, crc = 0, bit;
+		++tries;
+		if(bus_reset() != RESET_PRESENCE) {
+			if(!found && !last) { /* nobody there */
+				serial_write(SEARCH_DONE);
+				return;
+			}
+			continue;
+		}
+		bus_send_byte_plain(cmd);
+		for(bit = 1; bit <= 64; ++bit) {
+			uint8_t *p = &rom[(bit - 1) >> 3];
+			uint8_t mask = 1 << ((bit - 1) & 7);
+			uint8_t a = bus_send_bit(1);
+			uint8_t b = bus_send_bit(1);
+			uint8_t dir;
+			if(a && b)
+				break; /* nobody (left) */
+			if(a != b)
+				dir = a;
+			else {
+				dir = (bit < last) ? ((*p & mask) != 0) : (bit == last);
+				if(!dir)
+					fork = bit;
+			}
+			if(dir)
+				*p |= mask;
+			else
+				*p &= ~mask;
+			bus_send_bit(dir);
+		}
+		if(bit == 1 && !found && !last) { /* no device for this search */
+			serial_write(SEARCH_DONE);
+			return;
 		}
+		if(bit <= 64)
+			continue;
+		for(uint8_t i = 0; i < 8; ++i)
+			crc = ow_crc8_update(crc, rom[i]);
+		if(crc)
+			continue;
+		serial_write(SEARCH_FOUND);
+		for(uint8_t i = 0; i < 8; ++i)
+			serial_write(rom[i]);
+		found = 1;
+		tries = 0;
+		last = fork;
+		if(!last) {
+			serial_write(SEARCH_DONE);
+			return;
+		}
+	}
+	serial_write(SEARCH_FAILED);
+}
+
+/*
+ * Vendor extension: a batch of bus operations, for transactions like
+ * reset, MATCH ROM, read the scratchpad that otherwise take a round trip
+ * per step. In command mode 0xBA, the script length and the script; the
+ * adapter runs it back to back at the current speed and replies with the
+ * number of result bytes, then the results as they come off the bus.
+ * A script that doesn't parse or doesn't fit is answered BATCH_REJECTED
+ * alone and not run.
+ *   0x01         reset, result as for the reset command (0xCD: presence)
+ *   0x02, 0x03   write a 0 or 1 bit, result the bit read
+ *   0x40 + n-1   write the n (1..64) bytes that follow, no result
+ *   0x80 + n-1   read n (1..128) bytes
+ */
+#define BATCH_LEN 128
+#define BATCH_REJECTED 0xFF
+
+static uint8_t batch[BATCH_LEN];
+
+/* result bytes of the script, -1 if it is no good */
+static int bus_batch_results(uint8_t len)
+{
+	int n = 0;
+	uint8_t i = 0;
+	while(i < len) {
+		uint8_t op = batch[i++];
+		if(op & 0x80)
+			n += (op & 0x7F) + 1;
+		else if(op & 0x40)
+			i += (op & 0x3F) + 1;
+		else if(op >= 0x01 && op <= 0x03)
+			++n;
+		else
+			return -1;
+	}
+	return (i > len || n >= BATCH_REJECTED) ? -1 : n;
+}
+
+void bus_batch()
+{
+	int c = serial_read_wait(), len = c, n;
+	for(uint8_t i = 0; c != SERIAL_BREAK && i < len; ++i) {
+		c = serial_read_wait();
+		if(i < BATCH_LEN)
+			batch[i] = c;
+	}
+	if(c == SERIAL_BREAK) {
+		serial_break = 1; /* for the main loop */
+		return;
+	}
+	n = len > BATCH_LEN ? -1 : bus_batch_results(len);
+	if(n < 0) {
+		serial_write(BATCH_REJECTED);
+		return;
 	}
+	serial_write(n);
+	for(uint8_t i = 0; i < len;) {
+		uint8_t op = batch[i++];
+		if(op & 0x80) {
+			for(n = (op & 0x7F) + 1; n; --n)
+				serial_write(bus_send_byte_plain(0xFF));
+		} else if(op & 0x40) {
+			for(n = (op & 0x3F) + 1; n; --n)
+				bus_send_byte_plain(batch[i++]);
+		} else if(op == 0x01) {
+			serial_write(bus_reset() | 0xCC);
+		} else {
+			serial_write(bus_send_bit(op & 0x01));
+		}
+	}
+}
+
+/*
+ * Vendor extension: channels, up to six buses on PD2..PD7 worked in
+ * parallel. A time slot serves all selected channels at once: the ones
+ * writing a 1 are released after the write-1 low time, the others after
+ * the write-0 low time, and one read of the port samples them all. In
+ * command mode 0xCA and a pin mask selects channels, the reply is the
+ * mask taken (DS2480_CHANNELS of it), 0 goes back to the main bus.
+ * With channels selected:
+ *   reset       two replies: the channels with a presence pulse, then the
+ *               ones already low (shorted, or a slave signalling)
+ *   single bit  the bit goes to every channel, the reply is the mask of
+ *               the channels that read a 1
+ *   data mode   a group of one byte per channel, lowest pin first, goes
+ *               out in 8 slots, the reply is the group of bytes read
+ * The search accelerator, the strong pull-up and the other vendor commands
+ * stay with the main bus.
+ */
+static uint8_t channels, chan_count, chan_n;
+static uint8_t chan_buf[8];
+
+#ifdef DS2480_TIMER1_ENABLE
+static inline void chan_delay(uint16_t t)
+{
+	bus_slot_wait(ds2480_hal_timer_read(), t);
+}
+#else
+static inline void chan_delay(uint16_t t)
+{
+	wait(t);
+}
+#endif
+
+/* a slot on every channel, those in ones write a 1; returns which read a 1 */
+uint8_t chan_send_bits(uint8_t ones)
+{
+	const struct timing_t *t = timings;
+	uint16_t low1 = t->tLOW1, dso = t->tDSO;
+	uint16_t low0 = t->tLOW0 - low1 - dso;
+	uint8_t r;
+	cli(); /* as in bus_send_bit() */
+	ds2480_hal_chan_pull_down(channels);
+	chan_delay(low1);
+	ds2480_hal_chan_release(ones);
+	chan_delay(dso);
+	r = ds2480_hal_chan_read() & ones;
+	sei();
+	chan_delay(low0);
+	ds2480_hal_chan_release(channels);
+	chan_delay(t->tREC0);
 	return r;
 }
-void bus_set_speed(uint8_t s) { }
-void bus_strong_pullup() { }
 
+/* the channels with a presence pulse, in *low those low from the start */
+uint8_t chan_reset(uint8_t *low)
+{
+	const struct timing_t *t = timings;
+	uint8_t high, r;
+	ds2480_hal_chan_pull_down(channels);
+	chan_delay(t->tRSTL);
+	ds2480_hal_chan_release(channels);
+	chan_delay(t->tSI);
+	high = ds2480_hal_chan_read() & channels;
+	chan_delay(t->tPDT);
+	r = high & ~ds2480_hal_chan_read();
+	chan_delay(t->rFILL - t->tSI - t->tPDT);
+	*low = channels & ~high;
+	return r;
+}
+
+/* chan_buf, a byte per channel, goes out bit-sliced, what was read replaces it */
+void chan_send_bytes()
+{
+	uint8_t slice[8], k;
+	for(uint8_t i = 0; i < 8; ++i) {
+		slice[i] = 0;
+		k = 0;
+		for(uint8_t pin = 0x01; pin; pin <<= 1)
+			if((channels & pin) && (chan_buf[k++] & (1 << i)))
+				slice[i] |= pin;
+	}
+	for(uint8_t i = 0; i < 8; ++i)
+		slice[i] = chan_send_bits(slice[i]);
+	k = 0;
+	for(uint8_t pin = 0x01; pin; pin <<= 1) {
+		if(!(channels & pin))
+			continue;
+		chan_buf[k] = 0;
+		for(uint8_t i = 0; i < 8; ++i)
+			if(slice[i] & pin)
+				chan_buf[k] |= 1 << i;
+		++k;
+	}
+}
+
+void chan_select(uint8_t mask)
+{
+	channels = mask & DS2480_CHANNELS;
+	chan_count = 0;
+	chan_n = 0;
+	for(uint8_t pin = 0x01; pin; pin <<= 1)
+		if(channels & pin)
+			++chan_count;
+}
+
+/* speed field of the communication commands, it stays for data mode */
+enum bus_speed_t {
+	SPEED_REGULAR = 0x00,
+	SPEED_FLEXIBLE = 0x01,
+	SPEED_OVERDRIVE = 0x02, /* 0x03 is regular too */
+};
+
+void bus_set_speed(uint8_t s)
+{
+	switch(s) {
+	case SPEED_FLEXIBLE:
+		timings = &timings_flexible;
+		break;
+	case SPEED_OVERDRIVE:
+		timings = &timings_overdrive;
+		break;
+	default:
+		timings = &timings_standard;
+		break;
+	}
+}
 union {
 	uint8_t cf[8];
 	struct { /* only lower 3 buts of each are used */
@@ -184,7 +601,92 @@ union {
 	} fields;
 } conf;
 
-void ds2480_update_conf(uint8_t index) { }
+static const uint8_t conf_power_up[8] = { 0, 0, 4, 4, 0, 0, 4, 0 };
+
+enum ds2480_param_t {
+	PARAM_PDSRC = 1, /* pull down slew rate, the AVR pin has just one */
+	PARAM_PPD,
+	PARAM_SPUD,
+	PARAM_W1LT,
+	PARAM_W0RT, /* also the data sample offset */
+	PARAM_LOAD, /* load sensor threshold, there is no load sensor */
+	PARAM_RBR, /* 9600, 19200, 57600, 115200, +4 inverted (not supported) */
+};
+
+/*
+ * Strong pull-up for parasite powered devices: after a single bit with
+ * bit 1 set, on a pulse command and, once a pulse command armed it (bit 1),
+ * after every data mode byte. It lasts SPUD, counted in 1.024mS ticks of
+ * timer 2, or until 0xF1. Meanwhile bytes keep coming in: configuration
+ * commands are served, the next command that needs the bus ends the pulse
+ * first, as 0xF1 would. The reply due at the end of the pulse goes out then.
+ */
+static const uint16_t spud_ticks[8] = { 16, 64, 128, 256, 512, 1024, 0, 0 }; /* 0: until ended */
+static volatile uint16_t pulse_ticks;
+static uint8_t pulse_on, spu_armed;
+static int pulse_reply; /* -1 for none */
+
+ISR(TIMER2_COMPA_vect)
+{
+	if(--pulse_ticks)
+		return;
+	ds2480_hal_spu_off();
+	ds2480_hal_tick_stop();
+	pulse_ended = 1;
+}
+
+void bus_pulse_end()
+{
+	if(!pulse_on)
+		return;
+	cli();
+	ds2480_hal_tick_stop();
+	ds2480_hal_spu_off();
+	pulse_ended = 0;
+	sei();
+	pulse_on = 0;
+	if(pulse_reply >= 0)
+		serial_write(pulse_reply);
+}
+
+void bus_pulse_start(int reply)
+{
+	uint16_t ticks = spud_ticks[conf.fields.spud];
+	bus_pulse_end();
+	pulse_on = 1;
+	pulse_reply = reply;
+	ds2480_hal_spu_on();
+	if(ticks) { /* 6 (dynamic) and 7 (infinite) last until ended */
+		pulse_ticks = ticks;
+		ds2480_hal_tick_start();
+	}
+}
+
+/*
+ * Flexible speed as the DS2480B does it: write-1 low time 8..15uS (W1LT),
+ * data sample offset and write-0 recovery 3..10uS (DSO/W0RT), the write-0
+ * low time and the reset stay regular. The slot grows with the recovery,
+ * both kinds of slot have the same length. Precomputed here, so
+ * bus_send_bit() only loads ready counts.
+ */
+void ds2480_update_conf(uint8_t index)
+{
+	uint8_t low1 = 8 + conf.fields.w1lt, dso = 3 + conf.fields.w0rt;
+	switch(index) {
+	case PARAM_W1LT:
+	case PARAM_W0RT:
+		timings_flexible.tLOW1 = uT(low1);
+		timings_flexible.tDSO = uT(dso);
+		timings_flexible.tHIGH1 = uT(57 - low1); /* 57 + dso in total */
+		timings_flexible.tREC0 = uT(dso);
+		break;
+	case PARAM_RBR:
+		serial_set_rate(conf.fields.rbr & 0x03); /* the reply goes at the new rate */
+		break;
+	default:
+		break;
+	}
+}
 
 enum ds2480_mode_t {
 	MODE_COMMAND,
@@ -194,33 +696,67 @@ enum ds2480_mode_t {
 
 enum ds2480_mode_t ds2480_mode;
 
+/*
+ * Power up state, also after a break (or any framing error, e.g. the PC
+ * still at the old rate): 9600 baud, default parameters, regular speed,
+ * command mode. Like the DS2480B, the next byte only calibrates.
+ */
+void ds2480_master_reset()
+{
+	for(uint8_t i = 0; i < sizeof(conf.cf); ++i)
+		conf.cf[i] = conf_power_up[i];
+	ds2480_update_conf(PARAM_W1LT);
+	ds2480_update_conf(PARAM_RBR);
+	serial_flushrx();
+	pulse_reply = -1;
+	bus_pulse_end();
+	spu_armed = 0;
+	chan_select(0);
+	bus_set_speed(SPEED_REGULAR);
+	search_accelerator_enabled = 0;
+	ds2480_mode = MODE_COMMAND;
+}
+
 void execute_command(unsigned char c)
 {
 	char r;
 	if(c & 0x80) { /* communication command */
-		bus_set_speed((c >> 2) & 0x03);
+		bus_pulse_end();
+		if((c & 0xE1) != 0xE1) /* bits 3-2 of a pulse aren't a speed */
+			bus_set_speed((c >> 2) & 0x03);
 		switch(c & 0xE1) {
 		case 0x81: /* single bit */
+			if(channels) {
+				serial_write(chan_send_bits((c & 0x10) ? channels : 0));
+				break;
+			}
 			r = bus_send_bit(c & 0x10);
 			r |= r << 1;
 			r |= c & 0x9C;
+			if(c & 0x02) /* strong pullup after time slot, a second reply at its end */
+				bus_pulse_start((r & 0x03) | 0xEC);
 			serial_write(r);
-			if(c & 0x02) { /* strong pullup after time slot */
-				bus_strong_pullup();
-				serial_write((r & 0x03) | 0xEC);
-			}
 			break;
 		case 0xA1: /* search accelerator control */
 			search_accelerator_enabled = (c & 0x10) ? 1 : 0;
 			break;
 		case 0xC1: /* reset */
+			if(channels) {
+				uint8_t low;
+				serial_write(chan_reset(&low));
+				serial_write(low);
+				break;
+			}
 			r = bus_reset() | 0xCC;
 			serial_write(r);
 			break;
-		case 0xE1: /* pulse */
-			/* XXX */
+		case 0xE1: /* pulse, the reply comes at its end */
+			spu_armed = c & 0x02;
 			r = (c & 0x1C) | 0xE0;
-			serial_write(r);
+			if(c & 0x10) /* 12V programming pulse, there is no VPP here */
+				serial_write(r);
+			else
+				bus_pulse_start((uint8_t)r);
 			break;
 		default:
 			break;
@@ -228,60 +764,119 @@ void execute_command(unsigned char c)
 	} else { /* configuration command */
 		r = c & 0x70;
 		if(r) { /* write param */
-			ds2480_update_conf(r >> 4);
 			conf.cf[r >> 4] = (c & 0x0E) >> 1;
+			ds2480_update_conf(r >> 4);
 			serial_write(c & 0xFE);
-		} else { /* read param */
+		} else { /* read param: 0 PPP VVV 0 */
 			r = conf.cf[(c & 0x0E) >> 1];
-			serial_write((c & 0xF0) | (r << 1));
+			serial_write(((c & 0x0E) << 3) | (r << 1));
 		}
 	}
 }
 
 void echo();
 
+/* command mode, also the byte after E3 in data mode that isn't E3 again */
+void command_byte(uint8_t c)
+{
+	int mask;
+	switch(c) {
+	case 0xE1: /* switch to data mode */
+		ds2480_mode = MODE_DATA;
+		break;
+	case 0xE3: /* switch to command mode */
+		break;
+	case 0xF1: /* pulse termination */
+		bus_pulse_end();
+		break;
+	case 0xF0: /* vendor: search */
+	case 0xEC: /* vendor: alarm search */
+		bus_pulse_end();
+		bus_search(c);
+		break;
+	case 0xBA: /* vendor: batch */
+		bus_pulse_end();
+		bus_batch();
+		break;
+	case 0xCA: /* vendor: channels */
+		bus_pulse_end();
+		mask = serial_read_wait();
+		if(mask == SERIAL_BREAK) {
+			serial_break = 1; /* for the main loop */
+			break;
+		}
+		chan_select(mask);
+		serial_write(channels);
+		break;
+	default:
+		execute_command(c);
+		break;
+	}
+}
+
+void data_byte(uint8_t c)
+{
+	bus_pulse_end();
+	if(channels) { /* a byte of the group */
+		chan_buf[chan_n++] = c;
+		if(chan_n == chan_count) {
+			chan_send_bytes();
+			for(chan_n = 0; chan_n < chan_count; ++chan_n)
+				serial_write(chan_buf[chan_n]);
+			chan_n = 0;
+		}
+		return;
+	}
+	c = bus_send_byte(c);
+	if(spu_armed)
+		bus_pulse_start(-1);
+	serial_write(c);
+}
+
 int main()
 {
-	unsigned char c, c2;
-	serial_init();
-	serial_flushrx();
+	int c, c2;
+	sei();
 #if 0
+	serial_set_rate(0);
 	echo();
 #endif
 	PIO_PORT(PORT) = 0;
+#ifdef DS2480_TIMER1_ENABLE
+	ds2480_hal_slot_setup();
+#endif
+reset:
+	ds2480_master_reset();
 	bus_reset();
-	serial_read_wait(); /* reset */
-	ds2480_mode = MODE_COMMAND;
+	if(serial_read_wait() == SERIAL_BREAK) /* reset */
+		goto reset;
 	for(;;) {
 		c = serial_read_wait();
+		if(c == SERIAL_BREAK)
+			goto reset;
+		if(c == SERIAL_PULSE_END) {
+			bus_pulse_end();
+			continue;
+		}
 		switch(ds2480_mode) {
 		case MODE_COMMAND:
-			switch(c) {
-			case 0xE1: /* switch to data mode */
-				ds2480_mode = MODE_DATA;
-				break;
-			case 0xE3: /* switch to command mode */
-			case 0xF1: /* pulse termination */
-				break;
-			default:
-				execute_command(c);
-				break;
-			}
+			command_byte(c);
 			break;
 		case MODE_DATA:
 			if(c == 0xE3) {
 				c2 = c;
 				ds2480_mode = MODE_CHECK;
 			} else {
-				serial_write(bus_send_byte(c));
+				data_byte(c);
 			}
 			break;
 		case MODE_CHECK:
-			if(c == c2)
-				serial_write(bus_send_byte(c));
-			else {
+			if(c == c2) {
+				ds2480_mode = MODE_DATA;
+				data_byte(c);
+			} else {
 				ds2480_mode = MODE_COMMAND;
-				execute_command(c);
+				command_byte(c);
 			}
 			break;
 		}
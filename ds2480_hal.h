@@ -0,0 +1,217 @@
+#ifndef DS2480_HAL_H_INCLUDED
+#define DS2480_HAL_H_INCLUDED
+
+/*
+ * What the ds2480 adapter needs on top of ows_hal.h (bus pin, busy waits):
+ * USART0 towards the PC, idle sleep, the strong pull-up and its timer, the
+ * extra channels, and with DS2480_TIMER1_ENABLE the time slots from timer 1.
+ * As in ows_hal.h, the AVR backend is inlined register access and with
+ * OWS_HOST the functions live in host/ds2480_host.c, which simulates the
+ * serial line and a bus full of slaves.
+ */
+
+#include "ows_hal.h"
+
+/*
+ * Channels: more buses on port D, a bit each. PD0/PD1 are the USART, PD7
+ * is the main bus as well.
+ */
+#define DS2480_CHANNELS 0xFC
+
+#ifndef OWS_HOST
+
+/* 8N1, double speed (ubrr = clk / 8 / baud - 1), receive interrupt on */
+static inline void ds2480_hal_uart_setup(uint16_t ubrr)
+{
+    PRR &= ~(1 << PRUSART0); /* PRUSART0 must be disabled by writing a logical zero */
+    UBRR0H = (unsigned char)(ubrr >> 8);
+    UBRR0L = (unsigned char)ubrr;
+    UCSR0A = 1<<U2X0;
+    UCSR0B = (1<<RXCIE0)|(1<<RXEN0)|(1<<TXEN0);
+    UCSR0C = (3<<UCSZ00);
+}
+
+/* framing error of the received byte, valid until it is read */
+static inline uint8_t ds2480_hal_uart_rx_error()
+{
+    return UCSR0A & (1<<FE0);
+}
+
+static inline uint8_t ds2480_hal_uart_read()
+{
+    return UDR0;
+}
+
+static inline void ds2480_hal_uart_write(uint8_t c)
+{
+    UCSR0A = 1<<U2X0 | 1<<TXC0; /* clears TXC0 */
+    UDR0 = c;
+}
+
+/* the last byte written has left the shift register */
+static inline uint8_t ds2480_hal_uart_tx_idle()
+{
+    return UCSR0A & (1<<TXC0);
+}
+
+static inline void ds2480_hal_uart_tx_irq_enable()
+{
+    UCSR0B |= 1<<UDRIE0;
+}
+
+static inline void ds2480_hal_uart_tx_irq_disable()
+{
+    UCSR0B &= ~(1<<UDRIE0);
+}
+
+/* idle mode, the USART keeps running and wakes us up */
+static inline void ds2480_hal_idle()
+{
+    SMCR = 1<<SE;
+    sleep_cpu();
+}
+
+/*
+ * Strong pull-up: the pin that reads the bus drives it high, plenty for
+ * parasite powered devices (a DS18B20 converting takes 1.5mA).
+ */
+static inline void ds2480_hal_spu_on()
+{
+#ifdef DS2480_TIMER1_ENABLE
+    PORTB |= 1<<PB0;
+    DDRB |= 1<<PB0;
+#else
+    OWPORT(PORT) |= OWMASK;
+    OWPORT(DDR) |= OWMASK;
+#endif
+}
+
+static inline void ds2480_hal_spu_off()
+{
+#ifdef DS2480_TIMER1_ENABLE
+    DDRB &= ~(1<<PB0);
+    PORTB &= ~(1<<PB0);
+#else
+    OWPORT(DDR) &= ~(OWMASK);
+    OWPORT(PORT) &= ~(OWMASK); /* back to open drain */
+#endif
+}
+
+/* channels: the same instruction drives all of them */
+static inline void ds2480_hal_chan_pull_down(uint8_t mask)
+{
+    DDRD |= mask;
+}
+
+static inline void ds2480_hal_chan_release(uint8_t mask)
+{
+    DDRD &= ~mask;
+}
+
+static inline uint8_t ds2480_hal_chan_read()
+{
+    return PIND;
+}
+
+/* timer 2: CTC, clk/128, compare A interrupt every 1.024mS */
+static inline void ds2480_hal_tick_start()
+{
+    PRR &= ~(1 << PRTIM2);
+    TCCR2A = 1<<WGM21;
+    TCNT2 = 0;
+    OCR2A = CLK_FREQ * 1024L / 128 / 1000 - 1;
+    TIFR2 = 1<<OCF2A;
+    TIMSK2 |= 1<<OCIE2A;
+    TCCR2B = 1<<CS22 | 1<<CS20;
+}
+
+static inline void ds2480_hal_tick_stop()
+{
+    TCCR2B = 0;
+    TIMSK2 &= ~(1<<OCIE2A);
+}
+
+#ifdef DS2480_TIMER1_ENABLE
+/*
+ * Timer 1 at clk/1 times the slots instead of busy waits: OC1A (PB1, D9)
+ * pulls the bus down through a Schottky diode, cathode at the pin, and
+ * ICP1 (PB0, D8) senses it. The master's edges and its samples then stay
+ * where they belong whatever the CPU is doing, interrupts included.
+ */
+static inline void ds2480_hal_slot_setup()
+{
+    TCCR1A = 1<<COM1A1 | 1<<COM1A0; /* set on match */
+    TCCR1B = 1<<CS10; /* normal mode, clk/1 */
+    TCCR1C = 1<<FOC1A; /* OC1A high, the bus is released */
+    DDRB |= 1<<PB1;
+}
+
+/*
+ * Pulls the bus down now, the OC1A match releases it low ticks later.
+ * The input capture then waits for the next rising (or falling) edge.
+ * Returns when the slot started. Interrupts must be off: the match has
+ * to be set up before the timer gets there.
+ */
+static inline uint16_t ds2480_hal_slot_start(uint16_t low, uint8_t rising)
+{
+    uint16_t t;
+    TCCR1A = 1<<COM1A1; /* clear on match */
+    TCCR1C = 1<<FOC1A;
+    t = TCNT1;
+    OCR1A = t + low;
+    TCCR1A = 1<<COM1A1 | 1<<COM1A0;
+    TCCR1B = rising ? (1<<ICES1 | 1<<CS10) : 1<<CS10;
+    TIFR1 = 1<<ICF1; /* our own falling edge, or the edge select change */
+    return t;
+}
+
+static inline uint16_t ds2480_hal_timer_read()
+{
+    return TCNT1;
+}
+
+/* the edge armed by ds2480_hal_slot_start() came, at *t */
+static inline uint8_t ds2480_hal_capture(uint16_t *t)
+{
+    if (!(TIFR1 & (1<<ICF1)))
+        return 0;
+    *t = ICR1;
+    return 1;
+}
+
+static inline uint8_t ds2480_hal_bus_read()
+{
+    return (PINB & (1<<PB0)) ? 1 : 0;
+}
+#endif /* DS2480_TIMER1_ENABLE */
+
+#else /* OWS_HOST */
+
+void ds2480_hal_uart_setup(uint16_t ubrr);
+uint8_t ds2480_hal_uart_rx_error();
+uint8_t ds2480_hal_uart_read();
+void ds2480_hal_uart_write(uint8_t c);
+uint8_t ds2480_hal_uart_tx_idle();
+void ds2480_hal_uart_tx_irq_enable();
+void ds2480_hal_uart_tx_irq_disable();
+void ds2480_hal_idle();
+void ds2480_hal_spu_on();
+void ds2480_hal_spu_off();
+void ds2480_hal_chan_pull_down(uint8_t mask);
+void ds2480_hal_chan_release(uint8_t mask);
+uint8_t ds2480_hal_chan_read();
+void ds2480_hal_tick_start();
+void ds2480_hal_tick_stop();
+void ds2480_hal_slot_setup();
+uint16_t ds2480_hal_slot_start(uint16_t low, uint8_t rising);
+uint16_t ds2480_hal_timer_read();
+uint8_t ds2480_hal_capture(uint16_t *t);
+uint8_t ds2480_hal_bus_read();
+
+#endif /* OWS_HOST */
+
+#endif /* DS2480_HAL_H_INCLUDED */
+
+/*
+ vim: ts=4 sw=4 sts=4 et
+*/
@@ -0,0 +1,16 @@
+#ifndef OWS_HOST_BOOT_H
+#define OWS_HOST_BOOT_H
+
+/*
+ * host build: flash is an array in ows_host.c. Erasing and writing a page
+ * halt the CPU as long as on the AVR, so there's never anything to wait for.
+ */
+
+#include <stdint.h>
+
+void boot_page_fill(uint16_t addr, uint16_t w);
+void boot_page_erase(uint16_t addr);
+void boot_page_write(uint16_t addr);
+#define boot_spm_busy_wait() do { } while (0)
+
+#endif
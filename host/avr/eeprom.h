@@ -0,0 +1,18 @@
+#ifndef OWS_HOST_EEPROM_H
+#define OWS_HOST_EEPROM_H
+
+/* host build: EEPROM is an array in ows_host.c, writes take as long as on the AVR */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define E2END 0x1FF
+
+uint8_t eeprom_read_byte(const uint8_t *addr);
+void eeprom_write_byte(uint8_t *addr, uint8_t value);
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_write_block(const void *src, void *dst, size_t n);
+int eeprom_is_ready(void);
+void eeprom_busy_wait(void);
+
+#endif
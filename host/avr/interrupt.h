@@ -0,0 +1,13 @@
+#ifndef OWS_HOST_INTERRUPT_H
+#define OWS_HOST_INTERRUPT_H
+
+/* host build: interrupt handlers are plain functions called by the simulator */
+
+#include "ows_host.h"
+
+#define sei() ows_host_sei()
+#define cli() ows_host_cli()
+#define ISR(vector, ...) void vector(void)
+#define EMPTY_INTERRUPT(vector) void vector(void) { }
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef OWS_HOST_IO_H
+#define OWS_HOST_IO_H
+
+/* host build: the I/O registers the device files touch are plain variables */
+
+#include <stdint.h>
+
+extern volatile uint8_t DDRB, PORTB, PINB, DDRC, PORTC, PINC, PCMSK, GIMSK, MCUCR, CLKPR;
+extern volatile uint8_t TCCR1, GTCCR, OCR1A, OCR1C, TIMSK, PLLCSR;
+extern volatile uint8_t SREG; /* only the I bit, sei() and cli() */
+
+/* ATTiny45 */
+#define FLASHEND 0xFFF
+#define SPM_PAGESIZE 64
+#define SIGNATURE_0 0x1E
+#define SIGNATURE_1 0x92
+#define SIGNATURE_2 0x06
+
+#define SE 5
+#define PCIE 5
+#define CTC1 7
+#define OCIE1A 6
+
+#endif
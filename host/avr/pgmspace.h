@@ -0,0 +1,14 @@
+#ifndef OWS_HOST_PGMSPACE_H
+#define OWS_HOST_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+
+/* a flash address rather than a pointer: the flash array of ows_host.c */
+uint8_t ows_host_flash_read(uint16_t addr);
+#define pgm_read_byte_near(addr) ows_host_flash_read(addr)
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef OWS_HOST_SLEEP_H
+#define OWS_HOST_SLEEP_H
+
+#include "ows_host.h"
+
+#define sleep_cpu() ows_host_sleep()
+#define sleep_enable()
+#define sleep_disable()
+#define set_sleep_mode(mode)
+
+#endif
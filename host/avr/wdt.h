@@ -0,0 +1,8 @@
+#ifndef OWS_HOST_WDT_H
+#define OWS_HOST_WDT_H
+
+#define wdt_reset()
+#define wdt_disable()
+#define wdt_enable(timeout)
+
+#endif
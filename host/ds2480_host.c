@@ -0,0 +1,991 @@
+/*
+ * Host backend of ds2480_hal.h: the ds2480 adapter firmware runs natively
+ * between a simulated serial line and a simulated 1-Wire bus.
+ *
+ * Time is counted in CPU clocks of the simulated ATMega168 and, as in
+ * ows_host.c, only passes in the HAL calls of the firmware; the USART
+ * interrupts are dispatched between them and idle sleep skips ahead to
+ * the next event. The PC at the other end of the line runs a script in a
+ * coroutine. The bus carries -n slaves (DS18B20 alike, family 28, every
+ * fourth one with an alarm), bit level state machines evaluated at the
+ * master's edges: one that sends a
+ * 0 holds the bus from the falling edge on, one that listens takes the
+ * length of the low pulse. They are parasite powered: CONVERT T (44) needs
+ * the strong pull-up within 10uS and for 750mS, else the temperature
+ * read afterwards is the 85C of a power-on reset. Timer 1 runs at clk/1
+ * with OC1A and ICP1 on the bus wire, for DS2480_TIMER1_ENABLE, timer 2
+ * ticks the strong pull-up. With -b the slaves are spread over that many
+ * buses, PD7 (the main bus) first, then PD6 down to PD2, for the channels.
+ *
+ * Script: commands separated by newlines or ';', '#' starts a comment.
+ *   baud N            line rate of the PC, 9600 at start
+ *   w XX [XX ...]     send bytes back to back, doesn't wait for them
+ *   break             send a break
+ *   r N               wait for N more bytes from the adapter, the result
+ *   expect XX [...]   fail unless the previous result matches
+ *   check F0|EC       ... unless it is the vendor search reply for the bus
+ *   wait US           let the line idle
+ *   latency US        the PC takes that long to act on what r got
+ *   lap               the time since the previous lap
+ * Every command prints one tab separated line: the command, its result
+ * and the time it took in uS. Overruns, line errors and interrupts served
+ * are counted at the end.
+ *
+ * usage: ds2480_host [-n slaves] [-b buses] [-c 'script' | script-file]
+ * Exits with the number of failed commands.
+ */
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "ds2480_hal.h"
+#include "ows_host.h"
+#include "ow_crc8.h"
+
+#define HOST_CLK_READ 7     /* bus poll: one iteration of the polling loops */
+#define HOST_CLK_IO 2       /* sbi/cbi/out */
+#define HOST_CLK_IRQ 8      /* interrupt response and reti */
+#define HOST_RUNOUT (100L * CLK_FREQ) /* adapter keeps running 100mS after the script */
+#define HOST_TIMEOUT (10000L * CLK_FREQ) /* r gives up after 10S */
+#define HOST_PC_STACK (256 * 1024)
+#define HOST_LINE 8192      /* bytes on their way to the adapter */
+#define HOST_RESULT 8192
+#define HOST_ARGS 1100
+#define HOST_SLAVES 256
+#define HOST_MAIN_BUS 7     /* PD7 */
+#define HOST_BUSES 6        /* PD7 down to PD2 */
+#define HOST_TICK (1024L * CLK_FREQ / 1000) /* timer 2 */
+#define HOST_CONVERSION (750000L * CLK_FREQ / 1000) /* DS18B20, 12 bits */
+#define US(t) ((uint64_t)(t) * CLK_FREQ / 1000)
+#define NEVER UINT64_MAX
+
+int ows_device_main(); /* main() of ds2480.c */
+void USART_RX_vect(void);
+void USART_UDRE_vect(void);
+void TIMER2_COMPA_vect(void);
+
+volatile uint8_t PORTB;
+
+static uint64_t now;        /* CPU clocks since start */
+static uint8_t irq_on;      /* global interrupt flag */
+static unsigned long irqs;  /* interrupts served */
+static jmp_buf host_done;
+
+/* the PC */
+static ucontext_t adapter_ctx, pc_ctx;
+static uint64_t pc_wake;    /* next PC event */
+static uint64_t pc_done;    /* script end, NEVER while running */
+static uint64_t pc_latency, pc_lap;
+static const char *script;
+static int failures;
+static uint32_t pc_bit;     /* clocks per bit */
+static struct {
+    uint8_t c, brk;
+    uint32_t bit;           /* sent at this rate */
+    uint64_t at;            /* stop bit done */
+} pc_line[HOST_LINE];
+static unsigned pc_line_head, pc_line_tail;
+static uint64_t pc_line_free;
+static uint8_t pc_in[HOST_RESULT];
+static int pc_in_len, pc_want;
+
+/* USART0 */
+static uint8_t uart_on, rx_irq, udre_irq;
+static uint32_t uart_bit;
+static uint8_t rx_fifo[2], rx_fe[2], rx_n;
+static uint8_t tx_buf, tx_full, tx_shift;
+static uint32_t tx_bit;     /* rate of the byte being shifted out */
+static uint64_t tx_done = NEVER;
+static unsigned long overruns, line_errors;
+
+/* the bus */
+enum {
+    SLAVE_IDLE,     /* until the next reset */
+    SLAVE_ROM,      /* receiving a ROM command */
+    SLAVE_MATCH,
+    SLAVE_SEARCH,   /* bit, complement, direction, 64 times */
+    SLAVE_FUNC,     /* selected, receiving a function command */
+    SLAVE_SEND,
+};
+
+static struct host_slave {
+    uint8_t rom[8];
+    uint8_t scratchpad[9];
+    uint8_t od, alarm, state, after;
+    uint8_t conv, conv_ok;  /* converting, the strong pull-up came in time */
+    uint64_t conv_from;
+    uint8_t rx, out[9], out_len;
+    uint16_t bit;
+    uint64_t low_from, low_until; /* the slave holds the bus */
+    uint8_t bus;            /* pin of port D */
+} slaves[HOST_SLAVES];
+static int nslaves = 1, nbuses = 1;
+static struct {
+    uint8_t master_low;
+    uint64_t master_fall, master_rise;
+} buses[8];
+
+/* timer 1 */
+static uint64_t oc1a_at = NEVER; /* the match releases the bus */
+static uint64_t icp_armed;
+static uint8_t icp_rising;
+
+/* timer 2, the strong pull-up */
+static uint64_t t2_next = NEVER;
+static uint8_t t2_flag;
+static uint8_t spu_on;
+static uint64_t spu_from;
+
+void __attribute__((weak)) USART_RX_vect(void) { }
+void __attribute__((weak)) USART_UDRE_vect(void) { }
+void __attribute__((weak)) TIMER2_COMPA_vect(void) { }
+
+static void host_exit()
+{
+    longjmp(host_done, 1);
+}
+
+/* slaves */
+
+static uint8_t slave_bit(const uint8_t *buf, uint16_t bit)
+{
+    return (buf[bit >> 3] >> (bit & 7)) & 1;
+}
+
+static void slave_hold(struct host_slave *s, uint64_t from, uint64_t until)
+{
+    s->low_from = from;
+    s->low_until = until;
+}
+
+static void slave_send(struct host_slave *s, const uint8_t *buf, uint8_t len, uint8_t after)
+{
+    memcpy(s->out, buf, len);
+    s->out_len = len;
+    s->after = after;
+    s->state = SLAVE_SEND;
+    s->bit = 0;
+}
+
+static void slave_scratchpad_crc(struct host_slave *s)
+{
+    s->scratchpad[8] = 0;
+    for (int k = 0; k < 8; ++k)
+        s->scratchpad[8] = ow_crc8_update(s->scratchpad[8], s->scratchpad[k]);
+}
+
+/* the conversion is over at t: a degree warmer, or 85C without the power */
+static void slave_convert_end(struct host_slave *s, uint64_t t)
+{
+    int i = s - slaves;
+    if (!s->conv)
+        return;
+    s->conv = 0;
+    if (s->conv_ok && t - s->conv_from >= HOST_CONVERSION) {
+        s->scratchpad[0] = 0xA0 + i;
+        s->scratchpad[1] = 0x01;
+    } else {
+        s->scratchpad[0] = 0x50;
+        s->scratchpad[1] = 0x05;
+    }
+    slave_scratchpad_crc(s);
+}
+
+static void slave_byte(struct host_slave *s, uint8_t b)
+{
+    if (s->state == SLAVE_ROM) {
+        s->bit = 0;
+        switch (b) {
+            case 0x33: slave_send(s, s->rom, 8, SLAVE_FUNC); break;
+            case 0x55: s->state = SLAVE_MATCH; break;
+            case 0xCC: s->state = SLAVE_FUNC; break;
+            case 0xF0: s->state = SLAVE_SEARCH; break;
+            case 0xEC: s->state = s->alarm ? SLAVE_SEARCH : SLAVE_IDLE; break;
+            case 0x3C: s->od = 1; s->state = SLAVE_FUNC; break;
+            case 0x69: s->od = 1; s->state = SLAVE_MATCH; break;
+            default: s->state = SLAVE_IDLE; break;
+        }
+    } else {
+        switch (b) {
+            case 0xBE: slave_send(s, s->scratchpad, 9, SLAVE_IDLE); break;
+            case 0x44:
+                s->conv = 1;
+                s->conv_ok = 0;
+                s->conv_from = now;
+                s->state = SLAVE_IDLE;
+                break;
+            default: s->state = SLAVE_IDLE; break;
+        }
+    }
+}
+
+/* the master pulled the idle bus down */
+static void slave_fall(struct host_slave *s)
+{
+    uint8_t b = 1;
+    slave_convert_end(s, now); /* the bus is used, no power left */
+    if (s->state == SLAVE_SEND)
+        b = slave_bit(s->out, s->bit);
+    else if (s->state == SLAVE_SEARCH && s->bit % 3 != 2)
+        b = slave_bit(s->rom, s->bit / 3) ^ (s->bit % 3);
+    if (!b)
+        slave_hold(s, now, now + (s->od ? US(3) : US(30)));
+}
+
+/* ... and released it after low clocks */
+static void slave_rise(struct host_slave *s, uint64_t low)
+{
+    uint8_t b = low < (s->od ? US(2) : US(15)); /* what the slave samples */
+
+    if (low >= US(400) || (s->od && low >= US(48))) {
+        if (low >= US(400))
+            s->od = 0;
+        s->state = SLAVE_ROM;
+        s->bit = 0;
+        if (s->od)
+            slave_hold(s, now + US(3), now + US(13));
+        else
+            slave_hold(s, now + US(30), now + US(150));
+        return;
+    }
+    switch (s->state) {
+        case SLAVE_ROM:
+        case SLAVE_FUNC:
+            s->rx = (s->rx >> 1) | (b << 7);
+            if (++s->bit == 8)
+                slave_byte(s, s->rx);
+            break;
+        case SLAVE_MATCH:
+            if (b != slave_bit(s->rom, s->bit)) {
+                s->od = 0; /* only the matching slave stays in overdrive */
+                s->state = SLAVE_IDLE;
+            } else if (++s->bit == 64) {
+                s->state = SLAVE_FUNC;
+                s->bit = 0;
+            }
+            break;
+        case SLAVE_SEARCH:
+            if (s->bit % 3 == 2 && b != slave_bit(s->rom, s->bit / 3))
+                s->state = SLAVE_IDLE;
+            else if (++s->bit == 3 * 64) {
+                s->state = SLAVE_FUNC;
+                s->bit = 0;
+            }
+            break;
+        case SLAVE_SEND:
+            if (++s->bit == 8 * s->out_len) {
+                s->state = s->after;
+                s->bit = 0;
+            }
+            break;
+    }
+}
+
+/* the level of bus b at t, from the master's last pulse on */
+static uint8_t host_bus_at(uint8_t b, uint64_t t)
+{
+    if (b == HOST_MAIN_BUS && spu_on && t >= spu_from)
+        return 1;
+    if (t >= buses[b].master_fall && (buses[b].master_low || t < buses[b].master_rise))
+        return 0;
+    for (int i = 0; i < nslaves; ++i)
+        if (slaves[i].bus == b && slaves[i].low_from <= t && t < slaves[i].low_until)
+            return 0;
+    return 1;
+}
+
+static uint8_t host_bus()
+{
+    return host_bus_at(HOST_MAIN_BUS, now);
+}
+
+/* the first rising or falling edge of the main bus in (from, now], NEVER if none */
+static uint64_t host_bus_edge(uint64_t from, uint8_t rising)
+{
+    const uint8_t b = HOST_MAIN_BUS;
+    uint64_t edge = NEVER;
+    uint64_t c[2 * HOST_SLAVES + 2];
+    int n = 0;
+
+    c[n++] = buses[b].master_fall;
+    c[n++] = buses[b].master_rise;
+    for (int i = 0; i < nslaves; ++i)
+        if (slaves[i].bus == b) {
+            c[n++] = slaves[i].low_from;
+            c[n++] = slaves[i].low_until;
+        }
+    for (int i = 0; i < n; ++i)
+        if (c[i] > from && c[i] <= now && c[i] < edge
+                && host_bus_at(b, c[i]) == rising && host_bus_at(b, c[i] - 1) != rising)
+            edge = c[i];
+    return edge;
+}
+
+/* a small population of DS18B20 */
+static void host_slaves_setup()
+{
+    uint32_t x = 0x2480;
+    for (int i = 0; i < nslaves; ++i) {
+        struct host_slave *s = &slaves[i];
+        s->rom[0] = 0x28;
+        for (int k = 1; k < 7; ++k) {
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            s->rom[k] = x;
+        }
+        s->rom[7] = 0;
+        for (int k = 0; k < 7; ++k)
+            s->rom[7] = ow_crc8_update(s->rom[7], s->rom[k]);
+        s->alarm = i % 4 == 3;
+        s->bus = HOST_MAIN_BUS - i % nbuses;
+        s->scratchpad[0] = 0x90 + i; /* 25C and some */
+        s->scratchpad[1] = 0x01;
+        s->scratchpad[2] = s->alarm ? 0x14 : 0x4B; /* TH 20C or 75C */
+        s->scratchpad[3] = 0x46;
+        s->scratchpad[4] = 0x7F;
+        s->scratchpad[5] = 0xFF;
+        s->scratchpad[6] = 0x0C;
+        s->scratchpad[7] = 0x10;
+        slave_scratchpad_crc(s);
+    }
+}
+
+/* serial line */
+
+/* beyond 3% apart the receiver samples the wrong bits */
+static uint8_t host_line_garbled(uint32_t sent, uint32_t received)
+{
+    return (sent > received ? sent - received : received - sent) * 100 > 3 * sent;
+}
+
+static void host_uart_receive(uint8_t c, uint8_t brk, uint32_t bit)
+{
+    if (!uart_on)
+        return;
+    if (rx_n == 2) {
+        ++overruns; /* the third one in the shift register is lost */
+        return;
+    }
+    rx_fe[rx_n] = brk || host_line_garbled(bit, uart_bit);
+    if (rx_fe[rx_n]) {
+        ++line_errors;
+        c = 0;
+    }
+    rx_fifo[rx_n++] = c;
+}
+
+static void host_pc_receive(uint8_t c)
+{
+    if (host_line_garbled(tx_bit, pc_bit)) {
+        ++line_errors;
+        return;
+    }
+    if (pc_in_len < HOST_RESULT)
+        pc_in[pc_in_len++] = c;
+    if (pc_want && pc_in_len >= pc_want)
+        pc_wake = now;
+}
+
+static void host_uart_shift(uint8_t c)
+{
+    tx_shift = c;
+    tx_bit = uart_bit;
+    tx_done = now + 10 * uart_bit;
+}
+
+/* events */
+
+static uint64_t host_next_event()
+{
+    uint64_t t = pc_wake;
+    if (pc_line_head != pc_line_tail && pc_line[pc_line_head % HOST_LINE].at < t)
+        t = pc_line[pc_line_head % HOST_LINE].at;
+    if (tx_done < t)
+        t = tx_done;
+    if (oc1a_at < t)
+        t = oc1a_at;
+    if (t2_next < t)
+        t = t2_next;
+    if (pc_done != NEVER && pc_done + HOST_RUNOUT < t)
+        t = pc_done + HOST_RUNOUT;
+    return t;
+}
+
+/* serve pending interrupts, returns the clocks they took */
+static uint64_t host_dispatch()
+{
+    uint64_t t0 = now;
+    while (irq_on) {
+        void (*isr)(void);
+        if (t2_flag) {
+            t2_flag = 0;
+            isr = TIMER2_COMPA_vect;
+        } else if (rx_irq && rx_n)
+            isr = USART_RX_vect;
+        else if (udre_irq && uart_on && !tx_full)
+            isr = USART_UDRE_vect;
+        else
+            break;
+        irq_on = 0;
+        ++irqs;
+        now += HOST_CLK_IRQ;
+        isr();
+        irq_on = 1;
+    }
+    return now - t0;
+}
+
+static void host_bus_rise(uint8_t b);
+
+static uint64_t host_events()
+{
+    if (oc1a_at <= now) {
+        oc1a_at = NEVER;
+        host_bus_rise(HOST_MAIN_BUS);
+    }
+    if (t2_next <= now) {
+        t2_flag = 1;
+        t2_next += HOST_TICK;
+    }
+    if (pc_wake <= now)
+        swapcontext(&adapter_ctx, &pc_ctx);
+    while (pc_line_head != pc_line_tail && pc_line[pc_line_head % HOST_LINE].at <= now) {
+        unsigned i = pc_line_head % HOST_LINE;
+        host_uart_receive(pc_line[i].c, pc_line[i].brk, pc_line[i].bit);
+        ++pc_line_head;
+    }
+    if (tx_done <= now) {
+        host_pc_receive(tx_shift);
+        tx_done = NEVER;
+        if (tx_full) {
+            tx_full = 0;
+            host_uart_shift(tx_buf);
+        }
+    }
+    if (pc_done != NEVER && now >= pc_done + HOST_RUNOUT)
+        host_exit();
+    return host_dispatch();
+}
+
+/* run the rest of the world for the clocks an instruction sequence takes */
+static void host_advance(uint64_t clocks)
+{
+    uint64_t end = now + clocks;
+    for (;;) {
+        uint64_t t = host_next_event();
+        if (t > end)
+            break;
+        if (t > now)
+            now = t;
+        end += host_events(); /* interrupts delay the interrupted code */
+    }
+    now = end;
+    end += host_events();
+    now = end;
+}
+
+/* ows_hal.h */
+
+static void host_bus_fall(uint8_t b)
+{
+    if (!buses[b].master_low) {
+        buses[b].master_low = 1;
+        buses[b].master_fall = now;
+        for (int i = 0; i < nslaves; ++i)
+            if (slaves[i].bus == b)
+                slave_fall(&slaves[i]);
+    }
+}
+
+static void host_bus_rise(uint8_t b)
+{
+    if (buses[b].master_low) {
+        buses[b].master_low = 0;
+        buses[b].master_rise = now;
+        for (int i = 0; i < nslaves; ++i)
+            if (slaves[i].bus == b)
+                slave_rise(&slaves[i], now - buses[b].master_fall);
+    }
+}
+
+void ows_pull_bus_down()
+{
+    host_advance(HOST_CLK_IO);
+    host_bus_fall(HOST_MAIN_BUS);
+}
+
+void ows_release_bus()
+{
+    host_advance(HOST_CLK_IO);
+    host_bus_rise(HOST_MAIN_BUS);
+}
+
+uint8_t ows_read_bus()
+{
+    host_advance(HOST_CLK_READ);
+    return host_bus();
+}
+
+void ows_hal_delay4(uint16_t loops)
+{
+    host_advance(4 * (loops ? loops : 0x10000L));
+}
+
+void ows_hal_delay3(uint8_t loops)
+{
+    host_advance(3 * (loops ? loops : 0x100));
+}
+
+/* ds2480_hal.h */
+
+void ds2480_hal_uart_setup(uint16_t ubrr)
+{
+    host_advance(6 * HOST_CLK_IO);
+    uart_bit = 8 * (ubrr + 1); /* U2X0 */
+    uart_on = 1;
+    rx_irq = 1;
+    udre_irq = 0;
+}
+
+uint8_t ds2480_hal_uart_rx_error()
+{
+    host_advance(HOST_CLK_IO);
+    return rx_n && rx_fe[0];
+}
+
+uint8_t ds2480_hal_uart_read()
+{
+    uint8_t c = rx_fifo[0];
+    host_advance(HOST_CLK_IO);
+    if (rx_n) {
+        rx_fifo[0] = rx_fifo[1];
+        rx_fe[0] = rx_fe[1];
+        --rx_n;
+    }
+    return c;
+}
+
+void ds2480_hal_uart_write(uint8_t c)
+{
+    host_advance(HOST_CLK_IO);
+    if (!uart_on)
+        return;
+    if (tx_done == NEVER)
+        host_uart_shift(c);
+    else {
+        tx_buf = c;
+        tx_full = 1;
+    }
+}
+
+uint8_t ds2480_hal_uart_tx_idle()
+{
+    host_advance(HOST_CLK_IO);
+    return tx_done == NEVER && !tx_full;
+}
+
+void ds2480_hal_uart_tx_irq_enable()
+{
+    host_advance(HOST_CLK_IO);
+    udre_irq = 1;
+}
+
+void ds2480_hal_uart_tx_irq_disable()
+{
+    host_advance(HOST_CLK_IO);
+    udre_irq = 0;
+}
+
+void ds2480_hal_idle()
+{
+    ows_host_sleep();
+}
+
+void ds2480_hal_spu_on()
+{
+    host_advance(2 * HOST_CLK_IO);
+    if (spu_on)
+        return;
+    spu_on = 1;
+    spu_from = now;
+    for (int i = 0; i < nslaves; ++i)
+        if (slaves[i].bus == HOST_MAIN_BUS && slaves[i].conv && now - slaves[i].conv_from <= US(10))
+            slaves[i].conv_ok = 1;
+}
+
+void ds2480_hal_spu_off()
+{
+    host_advance(2 * HOST_CLK_IO);
+    if (!spu_on)
+        return;
+    spu_on = 0;
+    for (int i = 0; i < nslaves; ++i)
+        if (slaves[i].bus == HOST_MAIN_BUS)
+            slave_convert_end(&slaves[i], now);
+}
+
+/* DDRD &= or |= mask: all the pins switch in the same clock */
+void ds2480_hal_chan_pull_down(uint8_t mask)
+{
+    host_advance(HOST_CLK_IO);
+    for (uint8_t b = 0; b < 8; ++b)
+        if (mask & (1 << b))
+            host_bus_fall(b);
+}
+
+void ds2480_hal_chan_release(uint8_t mask)
+{
+    host_advance(HOST_CLK_IO);
+    for (uint8_t b = 0; b < 8; ++b)
+        if (mask & (1 << b))
+            host_bus_rise(b);
+}
+
+uint8_t ds2480_hal_chan_read()
+{
+    uint8_t r = 0;
+    host_advance(HOST_CLK_IO);
+    for (uint8_t b = 0; b < 8; ++b)
+        r |= host_bus_at(b, now) << b;
+    return r;
+}
+
+void ds2480_hal_tick_start()
+{
+    host_advance(7 * HOST_CLK_IO);
+    t2_next = now + HOST_TICK;
+    t2_flag = 0;
+}
+
+void ds2480_hal_tick_stop()
+{
+    host_advance(2 * HOST_CLK_IO);
+    t2_next = NEVER;
+    t2_flag = 0;
+}
+
+void ds2480_hal_slot_setup()
+{
+    host_advance(4 * HOST_CLK_IO);
+}
+
+uint16_t ds2480_hal_slot_start(uint16_t low, uint8_t rising)
+{
+    uint64_t t;
+    host_advance(2 * HOST_CLK_IO); /* COM1A, FOC1A */
+    host_bus_fall(HOST_MAIN_BUS);
+    t = now;
+    host_advance(4 * HOST_CLK_IO); /* TCNT1, OCR1A, COM1A */
+    oc1a_at = t + low;
+    if (oc1a_at <= now)
+        oc1a_at += 0x10000; /* missed, the next time round */
+    host_advance(2 * HOST_CLK_IO); /* TCCR1B, TIFR1 */
+    icp_armed = now;
+    icp_rising = rising;
+    return t;
+}
+
+uint16_t ds2480_hal_timer_read()
+{
+    host_advance(HOST_CLK_READ);
+    return now;
+}
+
+uint8_t ds2480_hal_capture(uint16_t *t)
+{
+    uint64_t edge;
+    host_advance(HOST_CLK_READ);
+    edge = host_bus_edge(icp_armed, icp_rising);
+    if (edge == NEVER)
+        return 0;
+    *t = edge;
+    return 1;
+}
+
+uint8_t ds2480_hal_bus_read()
+{
+    return ows_read_bus();
+}
+
+
+/* avr/interrupt.h, avr/sleep.h */
+
+void ows_host_sei(void)
+{
+    irq_on = 1;
+}
+
+void ows_host_cli(void)
+{
+    irq_on = 0;
+}
+
+void ows_host_sleep(void)
+{
+    unsigned long n = irqs;
+    for (;;) {
+        uint64_t t;
+        host_events();
+        if (irqs != n)
+            return;
+        t = host_next_event();
+        if (t == NEVER)
+            host_exit(); /* nothing will ever wake us up */
+        if (t > now)
+            now = t;
+    }
+}
+
+/* the PC */
+
+static void pc_delay(uint64_t clocks)
+{
+    pc_wake = now + clocks;
+    swapcontext(&pc_ctx, &adapter_ctx);
+}
+
+static void pc_send(uint8_t c, uint8_t brk)
+{
+    unsigned i = pc_line_tail % HOST_LINE;
+    if (pc_line_tail - pc_line_head == HOST_LINE)
+        pc_delay(pc_line[pc_line_head % HOST_LINE].at - now);
+    if (pc_line_free < now)
+        pc_line_free = now;
+    pc_line_free += 10 * pc_bit; /* start, 8 data, stop */
+    pc_line[i].c = c;
+    pc_line[i].brk = brk;
+    pc_line[i].bit = pc_bit;
+    pc_line[i].at = pc_line_free;
+    ++pc_line_tail;
+}
+
+/* hex bytes from argv, "55 3A 00" and "553A00" alike */
+static int pc_hex(char *argv[], int argc, uint8_t *buf, int size)
+{
+    int n = 0;
+    for (int i = 0; i < argc; ++i)
+        for (char *s = argv[i]; *s; s += 2) {
+            char h[3] = { s[0], s[1], 0 };
+            if (n == size || !isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1]))
+                return -1;
+            buf[n++] = strtoul(h, NULL, 16);
+        }
+    return n;
+}
+
+static uint8_t result[HOST_RESULT];
+static int result_len;
+static uint8_t produced; /* the command has a result */
+
+/* search order: the lower bit first at every fork */
+static int pc_rom_order(const void *a, const void *b)
+{
+    const struct host_slave *x = *(const struct host_slave **)a, *y = *(const struct host_slave **)b;
+    for (uint16_t bit = 0; bit < 64; ++bit)
+        if (slave_bit(x->rom, bit) != slave_bit(y->rom, bit))
+            return slave_bit(x->rom, bit) - slave_bit(y->rom, bit);
+    return 0;
+}
+
+/* the reply of the vendor search command on the main bus, returns its length */
+static int pc_search_reply(uint8_t cmd, uint8_t *buf)
+{
+    struct host_slave *found[HOST_SLAVES];
+    int n = 0, len = 0;
+    for (int i = 0; i < nslaves; ++i)
+        if (slaves[i].bus == HOST_MAIN_BUS && (cmd == 0xF0 || slaves[i].alarm))
+            found[n++] = &slaves[i];
+    qsort(found, n, sizeof(found[0]), pc_rom_order);
+    for (int i = 0; i < n; ++i) {
+        buf[len++] = 0x01;
+        memcpy(buf + len, found[i]->rom, 8);
+        len += 8;
+    }
+    buf[len++] = 0x00;
+    return len;
+}
+
+/* returns 0 if fine, 1 on failure */
+static int pc_cmd(char *argv[], int argc)
+{
+    uint8_t buf[HOST_RESULT];
+    int n;
+
+    if (!strcmp(argv[0], "baud") && argc == 2 && atol(argv[1]) > 0) {
+        pc_bit = CLK_FREQ * 1000L / atol(argv[1]);
+    } else if (!strcmp(argv[0], "w")) {
+        n = pc_hex(argv + 1, argc - 1, buf, sizeof(buf));
+        if (n < 0)
+            goto syntax;
+        for (int i = 0; i < n; ++i)
+            pc_send(buf[i], 0);
+    } else if (!strcmp(argv[0], "break") && argc == 1) {
+        pc_send(0, 1);
+    } else if (!strcmp(argv[0], "r") && argc == 2) {
+        uint64_t until = now + HOST_TIMEOUT;
+        n = atoi(argv[1]);
+        if (n <= 0 || n > HOST_RESULT)
+            goto syntax;
+        pc_want = n;
+        while (pc_in_len < n && now < until)
+            pc_delay(until - now);
+        pc_want = 0;
+        pc_delay(pc_latency);
+        result_len = pc_in_len < n ? pc_in_len : n;
+        memcpy(result, pc_in, result_len);
+        memmove(pc_in, pc_in + result_len, pc_in_len -= result_len);
+        produced = 1;
+    } else if (!strcmp(argv[0], "expect") || !strcmp(argv[0], "check")) {
+        if (argv[0][0] == 'c') {
+            uint8_t cmd;
+            if (argc != 2 || pc_hex(argv + 1, 1, &cmd, 1) != 1 || (cmd != 0xF0 && cmd != 0xEC))
+                goto syntax;
+            n = pc_search_reply(cmd, buf);
+        } else if ((n = pc_hex(argv + 1, argc - 1, buf, sizeof(buf))) < 0)
+            goto syntax;
+        if (n != result_len || memcmp(buf, result, n)) {
+            printf("# FAILED: expected");
+            for (int i = 0; i < n; ++i)
+                printf(" %02X", buf[i]);
+            printf("\n");
+            return 1;
+        }
+    } else if (!strcmp(argv[0], "wait") && argc == 2) {
+        pc_delay(US(atol(argv[1])));
+    } else if (!strcmp(argv[0], "latency") && argc == 2) {
+        pc_latency = US(atol(argv[1]));
+    } else if (!strcmp(argv[0], "lap") && argc == 1) {
+        /* timed by pc_run() */
+    } else {
+        goto syntax;
+    }
+    return 0;
+syntax:
+    printf("# FAILED: bad command\n");
+    return 1;
+}
+
+static void pc_run()
+{
+    char *s = strdup(script);
+
+    printf("# command\tresult\tus\n");
+    pc_lap = now;
+    for (char *line = s, *next; line; line = next) {
+        char *argv[HOST_ARGS];
+        int argc = 0;
+        uint64_t t0;
+
+        next = line + strcspn(line, ";\n");
+        next = *next ? (*next = 0, next + 1) : NULL;
+        line[strcspn(line, "#")] = 0;
+        for (char *a = strtok(line, " \t\r"); a && argc < HOST_ARGS; a = strtok(NULL, " \t\r"))
+            argv[argc++] = a;
+        if (!argc)
+            continue;
+
+        t0 = now;
+        if (!strcmp(argv[0], "lap")) {
+            t0 = pc_lap;
+            pc_lap = now;
+        }
+        produced = 0;
+        failures += pc_cmd(argv, argc);
+        for (int i = 0; i < argc; ++i)
+            printf("%s%s", i ? " " : "", argv[i]);
+        printf("\t");
+        for (int i = 0; produced && i < result_len; ++i)
+            printf("%02X", result[i]);
+        if (!produced || !result_len)
+            printf("-");
+        printf("\t%.1f\n", (now - t0) * 1000.0 / CLK_FREQ);
+    }
+    free(s);
+}
+
+static void host_pc()
+{
+    pc_delay(US(10000)); /* let the adapter boot */
+    pc_run();
+    fflush(stdout);
+    pc_done = now;
+    pc_wake = NEVER;
+    swapcontext(&pc_ctx, &adapter_ctx);
+}
+
+static char *host_read_file(const char *name)
+{
+    FILE *f = strcmp(name, "-") ? fopen(name, "r") : stdin;
+    char *buf = NULL;
+    size_t len = 0, size = 0;
+
+    if (!f) {
+        perror(name);
+        exit(255);
+    }
+    do {
+        if (len + 1 >= size)
+            buf = realloc(buf, size += 4096);
+        len += fread(buf + len, 1, size - len - 1, f);
+    } while (!feof(f) && !ferror(f));
+    buf[len] = 0;
+    if (f != stdin)
+        fclose(f);
+    return buf;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:b:c:")) != -1)
+        switch (opt) {
+            case 'n':
+                nslaves = atoi(optarg);
+                if (nslaves < 0 || nslaves > HOST_SLAVES)
+                    goto usage;
+                break;
+            case 'b':
+                nbuses = atoi(optarg);
+                if (nbuses < 1 || nbuses > HOST_BUSES)
+                    goto usage;
+                break;
+            case 'c':
+                script = optarg;
+                break;
+            default:
+                goto usage;
+        }
+    if (!script)
+        script = host_read_file(optind < argc ? argv[optind] : "-");
+
+    host_slaves_setup();
+    pc_bit = CLK_FREQ * 1000L / 9600;
+    pc_done = NEVER;
+    getcontext(&pc_ctx);
+    pc_ctx.uc_stack.ss_sp = malloc(HOST_PC_STACK);
+    pc_ctx.uc_stack.ss_size = HOST_PC_STACK;
+    pc_ctx.uc_link = NULL;
+    makecontext(&pc_ctx, host_pc, 0);
+
+    if (!setjmp(host_done))
+        ows_device_main();
+
+    printf("# %lu overruns, %lu line errors, %lu interrupts\n", overruns, line_errors, irqs);
+    if (pc_done == NEVER) {
+        fprintf(stderr, "adapter stopped before the end of the script\n");
+        return 255;
+    }
+    return failures;
+
+usage:
+    fprintf(stderr, "usage: %s [-n slaves] [-b buses] [-c 'script' | script-file]\n", argv[0]);
+    return 255;
+}
+
+/*
+ vim: ts=4 sw=4 sts=4 et
+*/
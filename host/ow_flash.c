@@ -0,0 +1,351 @@
+/*
+ * Delta firmware update through ows_spm(): of the pages an Intel HEX image
+ * touches, only those whose CRC16 differs from the device's are sent and
+ * programmed.
+ *
+ * The device is asked for its page size and flash size (CC), then for the
+ * CRC16s of the pages from the first the image touches to the last in one
+ * request (39). Each run of consecutive pages that differ is streamed in
+ * one request (55), a page programmed once its CRC checks out, and all of
+ * them are compared again at the end. Pages the image doesn't touch, the
+ * bootloader's for one, are left alone; the bytes of a touched page the
+ * image has nothing for are written FF.
+ *
+ * The bus is driven through the ow_master.h primitives; here the device
+ * is the simulated one of ows_host.c, built with OWS_HOST_MASTER.
+ *
+ * usage: ow_flash_host [-F flash.bin] [-- [-f] [-r ROM]] image.hex
+ *   -f       program every page of the image, changed or not
+ *   -r ROM   MATCH ROM (16 hex digits, family first) instead of SKIP ROM
+ * Prints what it did and the bus time it took, exits with 0 on success.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ow_master.h"
+#include "ow_crc16.h"
+#include "ows_host.h"
+
+#define OW_FLASH_SIZE 0x10000
+#define OW_FLASH_SPM_WAIT 10000000 /* nS, the device halts for erase and write */
+#define OW_FLASH_POLLS 1000        /* read slots for a page CRC, 70mS */
+#define OW_FLASH_RETRIES 3
+
+static uint8_t image[OW_FLASH_SIZE];
+static uint8_t touched[OW_FLASH_SIZE / 32]; /* per 32 bytes, the smallest page */
+static uint8_t rom[8];
+static uint8_t match;
+static uint16_t page_size;
+static uint32_t flash_size;
+static ow_crc16_t crc;
+
+/* image[] and touched[] from Intel HEX, 0 if fine */
+static int ow_flash_load(const char *name)
+{
+    FILE *f = fopen(name, "r");
+    char line[600];
+    uint32_t base = 0;
+    int n = 0;
+
+    if (!f) {
+        perror(name);
+        return -1;
+    }
+    memset(image, 0xFF, sizeof(image));
+    while (fgets(line, sizeof(line), f)) {
+        uint8_t rec[256 + 5], sum = 0;
+        int len;
+
+        ++n;
+        line[strcspn(line, "\r\n")] = 0;
+        if (!line[0])
+            continue;
+        for (len = 0; line[0] == ':' && line[1 + 2 * len] && len < (int)sizeof(rec); ++len) {
+            unsigned b;
+            if (sscanf(line + 1 + 2 * len, "%2x", &b) != 1)
+                break;
+            rec[len] = b;
+            sum += b;
+        }
+        if (line[0] != ':' || line[1 + 2 * len] || len < 5 || len != rec[0] + 5 || sum) {
+            fprintf(stderr, "%s:%d: not a HEX record\n", name, n);
+            fclose(f);
+            return -1;
+        }
+        switch (rec[3]) {
+            case 0x00: {
+                uint32_t addr = base + (rec[1] << 8 | rec[2]);
+                if (addr + rec[0] > OW_FLASH_SIZE) {
+                    fprintf(stderr, "%s:%d: beyond 64K\n", name, n);
+                    fclose(f);
+                    return -1;
+                }
+                for (int i = 0; i < rec[0]; ++i, ++addr) {
+                    image[addr] = rec[4 + i];
+                    touched[addr / 32] = 1;
+                }
+                break;
+            }
+            case 0x01:
+                fclose(f);
+                return 0;
+            case 0x02:
+                base = (rec[4] << 8 | rec[5]) << 4;
+                break;
+            case 0x04:
+                base = (uint32_t)(rec[4] << 8 | rec[5]) << 16;
+                break;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static uint16_t ow_flash_crc(const uint8_t *p, uint16_t n)
+{
+    ow_crc16_t c;
+    ow_crc16_reset(&c);
+    while (n--)
+        ow_crc16_update(&c, *p++);
+    return ow_crc16_get(&c);
+}
+
+static int ow_flash_touched(uint16_t page)
+{
+    for (uint32_t a = (uint32_t)page * page_size; a < (uint32_t)(page + 1) * page_size; a += 32)
+        if (touched[a / 32])
+            return 1;
+    return 0;
+}
+
+/* reset, select the device and send its function command: 0 if present */
+static int ow_flash_request(uint8_t cmd, uint16_t addr)
+{
+    if (!ow_master_reset())
+        return -1;
+    if (match) {
+        ow_master_write(0x55);
+        for (int i = 0; i < 8; ++i)
+            ow_master_write(rom[i]);
+    } else {
+        ow_master_write(0xCC);
+    }
+    ow_master_write(0xDA);
+    ow_master_write(cmd);
+    ow_master_write(addr >> 8);
+    ow_master_write(addr & 0xFF);
+    ow_crc16_reset(&crc);
+    return 0;
+}
+
+static void ow_flash_send(uint8_t b)
+{
+    ow_master_write(b);
+    ow_crc16_update(&crc, b);
+}
+
+static uint8_t ow_flash_recv(void)
+{
+    uint8_t b = ow_master_read();
+    ow_crc16_update(&crc, b);
+    return b;
+}
+
+/* the device's CRC16, high byte first, against ours: 0 if they match */
+static int ow_flash_check(void)
+{
+    uint16_t c = ow_crc16_get(&crc);
+    uint16_t d = ow_master_read() << 8;
+    d |= ow_master_read();
+    return c == d ? 0 : -1;
+}
+
+/* page size and flash size, CC */
+static int ow_flash_id(void)
+{
+    uint8_t id[8];
+
+    if (ow_flash_request(0xCC, 0) < 0)
+        return -1;
+    for (int i = 0; i < 8; ++i)
+        id[i] = ow_flash_recv();
+    if (ow_flash_check() < 0)
+        return -1;
+    page_size = id[3] ? id[3] : 256;
+    flash_size = (id[4] << 8 | id[5]) + 1;
+    printf("signature %02X%02X%02X, %u pages of %u bytes\n", id[0], id[1], id[2],
+        (unsigned)(flash_size / page_size), page_size);
+    return 0;
+}
+
+/* the CRC16s of n pages from first on, 39 */
+static int ow_flash_page_crcs(uint16_t first, uint8_t n, uint16_t crcs[])
+{
+    uint16_t addr = first * page_size;
+
+    if (ow_flash_request(0x39, addr) < 0)
+        return -1;
+    ow_crc16_update(&crc, 0x39);
+    ow_crc16_update(&crc, addr >> 8);
+    ow_crc16_update(&crc, addr & 0xFF);
+    ow_flash_send(n);
+    for (int p = 0; p < n; ++p) {
+        int polls = 0;
+        while (ow_master_read_bit()) /* the 00 in front, when it's ready */
+            if (++polls == OW_FLASH_POLLS)
+                return -1;
+        for (int i = 1; i < 8; ++i)
+            if (ow_master_read_bit())
+                return -1;
+        crcs[p] = ow_flash_recv() << 8;
+        crcs[p] |= ow_flash_recv();
+    }
+    return ow_flash_check();
+}
+
+static int ow_flash_all_crcs(uint16_t first, uint16_t n, uint16_t crcs[])
+{
+    for (uint16_t done = 0; done < n; ) {
+        uint8_t k = n - done > 255 ? 255 : n - done;
+        int tries = 0;
+        while (ow_flash_page_crcs(first + done, k, crcs + done) < 0)
+            if (++tries == OW_FLASH_RETRIES)
+                return -1;
+        done += k;
+    }
+    return 0;
+}
+
+/* n pages from first on, 55: the number programmed */
+static int ow_flash_stream(uint16_t first, uint8_t n)
+{
+    uint16_t addr = first * page_size;
+    int p;
+
+    if (ow_flash_request(0x55, addr) < 0)
+        return 0;
+    ow_crc16_update(&crc, 0x55);
+    ow_crc16_update(&crc, addr >> 8);
+    ow_crc16_update(&crc, addr & 0xFF);
+    ow_flash_send(n);
+    for (p = 0; p < n; ++p) {
+        for (uint16_t i = 0; i < page_size; ++i)
+            ow_flash_send(image[addr + p * page_size + i]);
+        if (ow_flash_check() < 0) {
+            ow_master_write(0x00); /* not programmed, the request ends */
+            break;
+        }
+        ow_master_write(0x5A);
+        ow_master_delay(OW_FLASH_SPM_WAIT);
+    }
+    return p;
+}
+
+static int ow_flash_usage(void)
+{
+    fprintf(stderr, "usage: ow_flash_host [-F flash.bin] [-- [-f] [-r ROM]] image.hex\n");
+    return 255;
+}
+
+int ows_host_master(int argc, char *argv[])
+{
+    uint16_t *have = NULL, first, last, pages = 0, changed = 0, programmed = 0, bad = 0;
+    uint64_t t0 = ow_master_time();
+    uint8_t full = 0, *todo = NULL;
+    int i, ret = 1;
+
+    for (i = 0; i < argc && argv[i][0] == '-'; ++i) {
+        if (!strcmp(argv[i], "-f")) {
+            full = 1;
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc && strlen(argv[i + 1]) == 16) {
+            ++i;
+            for (int j = 0; j < 8; ++j)
+                if (sscanf(argv[i] + 2 * j, "%2hhx", &rom[j]) != 1)
+                    return ow_flash_usage();
+            match = 1;
+        } else {
+            return ow_flash_usage();
+        }
+    }
+    if (i + 1 != argc)
+        return ow_flash_usage();
+    if (ow_flash_load(argv[i]) < 0)
+        return 1;
+
+    if (ow_flash_id() < 0) {
+        fprintf(stderr, "no answer to CC\n");
+        return 1;
+    }
+    for (first = 0; first < flash_size / page_size && !ow_flash_touched(first); ++first)
+        ;
+    for (last = first, i = first; i < (int)(OW_FLASH_SIZE / page_size); ++i)
+        if (ow_flash_touched(i)) {
+            last = i;
+            ++pages;
+        }
+    if (!pages || (uint32_t)(last + 1) * page_size > flash_size) {
+        fprintf(stderr, "%s: %s\n", argv[argc - 1], pages ? "bigger than the flash" : "empty");
+        return 1;
+    }
+
+    /* what differs */
+    have = calloc(last - first + 1, sizeof(*have));
+    todo = calloc(last - first + 1, 1);
+    if (!have || !todo) {
+        perror("ow_flash");
+        goto done;
+    }
+    if (!full && ow_flash_all_crcs(first, last - first + 1, have) < 0) {
+        fprintf(stderr, "page CRCs (39) failed\n");
+        goto done;
+    }
+    for (i = first; i <= last; ++i)
+        if (ow_flash_touched(i) && (full || have[i - first] != ow_flash_crc(image + i * page_size, page_size))) {
+            todo[i - first] = 1;
+            ++changed;
+        }
+    printf("%u of %u pages to program\n", changed, pages);
+
+    /* runs of pages to program, one request each, retried from where it broke */
+    for (i = first; i <= last; ) {
+        int n = 0, tries = 0;
+        if (!todo[i - first]) {
+            ++i;
+            continue;
+        }
+        while (i + n <= last && todo[i + n - first] && n < 255)
+            ++n;
+        while (n) {
+            int k = ow_flash_stream(i, n);
+            programmed += k;
+            i += k;
+            n -= k;
+            if (!k && ++tries == OW_FLASH_RETRIES) {
+                fprintf(stderr, "page %04X: stream (55) failed\n", i * page_size);
+                goto done;
+            }
+        }
+    }
+
+    /* everything as in the image */
+    if (ow_flash_all_crcs(first, last - first + 1, have) < 0) {
+        fprintf(stderr, "page CRCs (39) failed\n");
+        goto done;
+    }
+    for (i = first; i <= last; ++i)
+        if (ow_flash_touched(i) && have[i - first] != ow_flash_crc(image + i * page_size, page_size)) {
+            fprintf(stderr, "page %04X differs\n", i * page_size);
+            ++bad;
+        }
+    printf("%u programmed, %u unchanged, %.1f mS on the bus\n", programmed, pages - programmed,
+        (ow_master_time() - t0) / 1e6);
+    ret = bad ? 1 : 0;
+done:
+    free(have);
+    free(todo);
+    return ret;
+}
+
+/*
+ vim: ts=4 sw=4 sts=4 et
+*/
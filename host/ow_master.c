@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include "ow_master.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* AN126 delays A..J in nS, G is not needed */
+static const struct ow_master_timing {
+    uint32_t a, b, c, d, e, f, h, i, j;
+} ow_master_timings[2] = {
+    { 6000, 64000, 60000, 10000, 9000, 55000, 480000, 70000, 410000 },
+    { 1000,  7500,  7500,  2500, 1000,  7000,  70000,  8500,  40000 },
+};
+
+static const struct ow_master_timing *t = &ow_master_timings[0];
+
+void ow_master_speed(uint8_t od)
+{
+    t = &ow_master_timings[od ? 1 : 0];
+}
+
+uint8_t ow_master_reset(void)
+{
+    uint8_t r;
+
+    ow_master_drive(1);
+    ow_master_delay(t->h);
+    ow_master_drive(0);
+    ow_master_delay(t->i);
+    r = !ow_master_sample();
+    ow_master_delay(t->j);
+    return r;
+}
+
+void ow_master_write_bit(uint8_t b)
+{
+    ow_master_drive(1);
+    ow_master_delay(b ? t->a : t->c);
+    ow_master_drive(0);
+    ow_master_delay(b ? t->b : t->d);
+}
+
+uint8_t ow_master_read_bit(void)
+{
+    uint8_t r;
+
+    ow_master_drive(1);
+    ow_master_delay(t->a);
+    ow_master_drive(0);
+    ow_master_delay(t->e);
+    r = ow_master_sample();
+    ow_master_delay(t->f);
+    return r;
+}
+
+void ow_master_write(uint8_t b)
+{
+    for (uint8_t mask = 0x01; mask; mask <<= 1)
+        ow_master_write_bit(b & mask);
+}
+
+uint8_t ow_master_read(void)
+{
+    uint8_t r = 0;
+    for (uint8_t mask = 0x01; mask; mask <<= 1)
+        if (ow_master_read_bit())
+            r |= mask;
+    return r;
+}
+
+/* AN187 search, returns the number of ROMs found */
+uint8_t ow_master_search(uint8_t cmd, uint8_t roms[][8], uint8_t max)
+{
+    uint8_t rom[8] = { 0 };
+    uint8_t last = 0, n = 0; /* last zero fork, 1 based */
+
+    while (n < max) {
+        uint8_t fork = 0;
+        if (!ow_master_reset())
+            break;
+        ow_master_write(cmd);
+        for (uint8_t bit = 1; bit <= 64; ++bit) {
+            uint8_t *p = &rom[(bit - 1) >> 3];
+            uint8_t mask = 1 << ((bit - 1) & 7);
+            uint8_t a = ow_master_read_bit();
+            uint8_t b = ow_master_read_bit();
+            uint8_t dir;
+            if (a && b)
+                return n; /* nobody (left) */
+            if (a != b)
+                dir = a;
+            else {
+                dir = (bit < last) ? ((*p & mask) != 0) : (bit == last);
+                if (!dir)
+                    fork = bit;
+            }
+            if (dir)
+                *p |= mask;
+            else
+                *p &= ~mask;
+            ow_master_write_bit(dir);
+        }
+        memcpy(roms[n++], rom, 8);
+        last = fork;
+        if (!last)
+            break;
+    }
+    return n;
+}
+
+/* hex bytes from argv, "55 3A 00" and "553A00" alike */
+static int ow_master_hex(char *argv[], int argc, uint8_t *buf, int size)
+{
+    int n = 0;
+    for (int i = 0; i < argc; ++i)
+        for (char *s = argv[i]; *s; s += 2) {
+            char h[3] = { s[0], s[1], 0 };
+            if (n == size || !isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1]))
+                return -1;
+            buf[n++] = strtoul(h, NULL, 16);
+        }
+    return n;
+}
+
+#define OW_MASTER_ARGS 80
+#define OW_MASTER_RESULT 256
+
+static uint8_t result[OW_MASTER_RESULT];
+static int result_len;
+static uint8_t produced; /* the command has a result */
+
+/* returns 0 if fine, 1 on failure */
+static int ow_master_cmd(char *argv[], int argc, FILE *out)
+{
+    uint8_t buf[OW_MASTER_RESULT];
+    int n;
+
+    if (!strcmp(argv[0], "reset") && argc == 1) {
+        result[0] = ow_master_reset();
+        result_len = 1;
+        produced = 1;
+    } else if (!strcmp(argv[0], "std") && argc == 1) {
+        ow_master_speed(0);
+    } else if (!strcmp(argv[0], "od") && argc == 1) {
+        ow_master_speed(1);
+    } else if (!strcmp(argv[0], "w") || !strcmp(argv[0], "match")) {
+        uint8_t match = argv[0][0] == 'm';
+        n = ow_master_hex(argv + 1, argc - 1, buf, sizeof(buf));
+        if (n < 0 || (match && n != 8))
+            goto syntax;
+        if (match)
+            ow_master_write(0x55);
+        for (int i = 0; i < n; ++i)
+            ow_master_write(buf[i]);
+    } else if (!strcmp(argv[0], "r") && argc == 2) {
+        n = atoi(argv[1]);
+        if (n <= 0 || n > OW_MASTER_RESULT)
+            goto syntax;
+        for (result_len = 0; result_len < n; ++result_len)
+            result[result_len] = ow_master_read();
+        produced = 1;
+    } else if (!strcmp(argv[0], "search") && argc <= 2) {
+        uint8_t cmd = 0xF0;
+        if (argc == 2 && ow_master_hex(argv + 1, 1, &cmd, 1) != 1)
+            goto syntax;
+        n = ow_master_search(cmd, (uint8_t (*)[8])result, OW_MASTER_RESULT / 8);
+        result_len = n * 8;
+        produced = 1;
+    } else if (!strcmp(argv[0], "expect")) {
+        n = ow_master_hex(argv + 1, argc - 1, buf, sizeof(buf));
+        if (n < 0)
+            goto syntax;
+        if (n != result_len || memcmp(buf, result, n)) {
+            fprintf(out, "# FAILED: expected");
+            for (int i = 0; i < n; ++i)
+                fprintf(out, " %02X", buf[i]);
+            fprintf(out, "\n");
+            return 1;
+        }
+    } else if (!strcmp(argv[0], "wait") && argc == 2) {
+        ow_master_delay(atol(argv[1]) * 1000);
+    } else {
+        goto syntax;
+    }
+    return 0;
+syntax:
+    fprintf(out, "# FAILED: bad command\n");
+    return 1;
+}
+
+int ow_master_run(const char *script, const char *tag, FILE *out)
+{
+    char *s = strdup(script);
+    int failures = 0;
+
+    fprintf(out, "# %scommand\tresult\tbus_us\tcpu_clocks\tresponse_us\n", tag ? "image\t" : "");
+    ow_master_response();
+    for (char *line = s, *next; line; line = next) {
+        char *argv[OW_MASTER_ARGS];
+        int argc = 0;
+        uint64_t t0, c0;
+
+        next = line + strcspn(line, ";\n");
+        next = *next ? (*next = 0, next + 1) : NULL;
+        line[strcspn(line, "#")] = 0;
+        for (char *a = strtok(line, " \t\r"); a && argc < OW_MASTER_ARGS; a = strtok(NULL, " \t\r"))
+            argv[argc++] = a;
+        if (!argc)
+            continue;
+
+        t0 = ow_master_time();
+        c0 = ow_master_cycles();
+        produced = 0;
+        failures += ow_master_cmd(argv, argc, out);
+        if (tag)
+            fprintf(out, "%s\t", tag);
+        for (int i = 0; i < argc; ++i)
+            fprintf(out, "%s%s", i ? " " : "", argv[i]);
+        fprintf(out, "\t");
+        for (int i = 0; produced && i < result_len; ++i)
+            fprintf(out, "%s%02X", (i && !(i & 7) && !strcmp(argv[0], "search")) ? " " : "", result[i]);
+        if (!produced || !result_len)
+            fprintf(out, "-");
+        fprintf(out, "\t%.1f\t%llu\t%.2f\n", (ow_master_time() - t0) / 1000.0,
+            (unsigned long long)(ow_master_cycles() - c0), ow_master_response() / 1000.0);
+    }
+    free(s);
+    return failures;
+}
+
+/*
+ vim: ts=4 sw=4 sts=4 et
+*/
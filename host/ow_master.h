@@ -0,0 +1,50 @@
+#ifndef OW_MASTER_H_INCLUDED
+#define OW_MASTER_H_INCLUDED
+
+/*
+ * Scripted 1-Wire bus master for the simulators. Bit timing is what Maxim
+ * AN126 recommends for standard and overdrive speed.
+ *
+ * Script: commands separated by newlines or ';', '#' starts a comment.
+ *   reset             reset pulse, result 01 on presence, 00 otherwise
+ *   std | od          master speed
+ *   w XX [XX ...]     write bytes (hex, may be run together: w 55 3A00..)
+ *   r N               read N bytes
+ *   match ROM         MATCH ROM, i.e. w 55 ROM
+ *   search [XX]       enumerate with SEARCH ROM (or XX, e.g. EC), result ROMs
+ *   expect XX [...]   fail unless the previous result matches
+ *   wait US           keep the bus idle
+ * Every command prints one tab separated line: the command, its result,
+ * the bus time it took, the CPU clocks the slave spent awake meanwhile and
+ * its slowest response, i.e. the longest time from the falling edge of a
+ * slot to the slave pulling the bus (the master samples 15uS, in overdrive
+ * 2uS, after the edge).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* provided by the simulator */
+void ow_master_drive(uint8_t low);   /* pull the bus down or release it */
+uint8_t ow_master_sample(void);      /* bus level right now */
+void ow_master_delay(uint32_t ns);   /* let the slave run meanwhile */
+uint64_t ow_master_time(void);       /* simulated time, nS */
+uint64_t ow_master_cycles(void);     /* slave CPU clocks out of sleep */
+uint32_t ow_master_response(void);   /* slowest response since the last call, nS */
+
+void ow_master_speed(uint8_t od);
+uint8_t ow_master_reset(void);       /* 1 on presence */
+void ow_master_write_bit(uint8_t b);
+uint8_t ow_master_read_bit(void);
+void ow_master_write(uint8_t b);
+uint8_t ow_master_read(void);
+uint8_t ow_master_search(uint8_t cmd, uint8_t roms[][8], uint8_t max);
+
+/* tag, if any, goes in front of every line; returns the number of failures */
+int ow_master_run(const char *script, const char *tag, FILE *out);
+
+#endif /* OW_MASTER_H_INCLUDED */
+
+/*
+ vim: ts=4 sw=4 sts=4 et
+*/
@@ -0,0 +1,705 @@
+/*
+ * Host backend of ows_hal.h: the slave core and a device file run natively
+ * against a simulated open-drain 1-Wire bus, driven by the scripted master
+ * of ow_master.c.
+ *
+ * Time is counted in CPU clocks of the simulated AVR (CLK_FREQ). The slave
+ * runs in the main context and time only passes in its HAL calls, each
+ * charged about what the AVR code takes. The master runs in a coroutine
+ * resumed whenever the clock reaches its next event. Pin change, timer 0
+ * compare, EEPROM ready and ADC complete interrupts are dispatched between
+ * HAL calls, just like the AVR does between instructions, and sleep skips
+ * ahead to the next event. The ADC inputs (ds2450_hal.h) are fractions of
+ * the reference, 0000..FFFF, dithered by a LSB of noise so oversampling
+ * gets more bits out of them as it does from a real input. Flash (ATTiny45)
+ * starts erased unless loaded, page erase and write halt the CPU for 4.5mS
+ * each, and a jump to 0 restarts the device's main().
+ *
+ * usage: <device>_host [-E eeprom.bin] [-F flash.bin] [-A a,b,c,d] [-c 'script' | script-file]
+ * without a script it is read from stdin, see ow_master.h for the syntax.
+ * Exits with the number of failed commands. With OWS_HOST_MASTER the
+ * master is ows_host_master() instead, given the arguments after the
+ * options, and the exit code is what it returns.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "ows_hal.h"
+#include "ds2450_hal.h"
+#include "ow_master.h"
+#include <avr/eeprom.h>
+#include <avr/boot.h>
+#include <avr/pgmspace.h>
+
+#define HOST_CLK_READ 7     /* bus poll: one iteration of the polling loops */
+#define HOST_CLK_IO 2       /* sbi/cbi/out */
+#define HOST_CLK_IRQ 8      /* interrupt response and reti */
+#define HOST_TIMER_TICK 64  /* timer 0 prescaler */
+#define HOST_EEPROM_WRITE (34L * CLK_FREQ / 10) /* 3.4mS per byte */
+#define HOST_SPM (45L * CLK_FREQ / 10) /* 4.5mS page erase or write */
+#define HOST_ADC_CONVERSION (13 * (CLK_FREQ > 12800 ? 128 : 64))
+#define HOST_RUNOUT (100L * CLK_FREQ) /* slave keeps running 100mS after the script */
+#define HOST_MASTER_STACK (256 * 1024)
+#define NEVER UINT64_MAX
+
+int ows_device_main(); /* main() of the device file */
+void OWPCINT_vect(void);
+void OWTIMER_COMPA_vect(void);
+void OWEE_READY_vect(void);
+void ADC_vect(void);
+
+volatile uint8_t DDRB, PORTB, PINB = 0xFF, DDRC, PORTC, PINC = 0xFF, PCMSK, GIMSK, MCUCR, CLKPR;
+volatile uint8_t TCCR1, GTCCR, OCR1A, OCR1C, TIMSK, PLLCSR;
+volatile uint8_t SREG;  /* bit 7: global interrupt flag */
+
+static uint64_t now;        /* CPU clocks since start */
+static uint64_t asleep;     /* ... of them in sleep */
+#define SREG_I 0x80
+static unsigned long irqs;  /* interrupts served */
+
+static ucontext_t slave_ctx, master_ctx;
+static uint64_t master_wake;    /* next master event */
+static uint64_t master_done;    /* script end, NEVER while running */
+static const char *script;
+#ifdef OWS_HOST_MASTER
+static char **master_argv;
+static int master_argc;
+#endif
+static int failures;
+static jmp_buf host_done, host_restart;
+
+static uint8_t master_low, slave_low;
+static uint64_t master_fall;    /* last falling edge made by the master */
+static uint64_t response;       /* slowest slave response to it */
+static uint8_t bus_seen = 1;
+static uint8_t pcint_on, pcif;
+
+static uint8_t tmr_on, tmr_irq, tmr_ocr, tmr_tov, ocf;
+static uint8_t tmr_count;   /* while stopped */
+static uint64_t tmr_base;   /* when the count was 0 */
+static uint64_t tmr_seen;   /* overflows and compares up to here are known */
+
+static uint8_t eeprom[E2END + 1];
+static uint64_t eeprom_ready;
+static uint8_t eeprom_irq;
+
+static uint8_t flash[FLASHEND + 1];
+static uint16_t spm_buffer[SPM_PAGESIZE / 2];
+
+static uint16_t adc_input[8] = { 0x0000, 0x4000, 0x8000, 0xFFFF };
+static uint8_t adc_mux, adc_flag, adc_irq;
+static uint16_t adc_result;
+static uint64_t adc_ready = NEVER;  /* end of the running conversion */
+static uint32_t adc_noise = 1;
+
+void __attribute__((weak)) OWTIMER_COMPA_vect(void) { }
+void __attribute__((weak)) OWEE_READY_vect(void) { }
+void __attribute__((weak)) ADC_vect(void) { }
+
+static uint8_t host_bus()
+{
+    return !(master_low || slave_low);
+}
+
+static void host_bus_changed()
+{
+    uint8_t b = host_bus();
+    if (b != bus_seen) {
+        bus_seen = b;
+        if (pcint_on)
+            pcif = 1;
+    }
+}
+
+static void host_exit()
+{
+    longjmp(host_done, 1);
+}
+
+/* timer 0 */
+
+static uint64_t host_timer_compare_at()
+{
+    uint64_t t, period = 256 * HOST_TIMER_TICK;
+    if (!tmr_on || !tmr_irq)
+        return NEVER;
+    t = tmr_base + (uint64_t)tmr_ocr * HOST_TIMER_TICK;
+    if (t <= tmr_seen)
+        t += ((tmr_seen - t) / period + 1) * period;
+    return t;
+}
+
+/* account for overflows up to now, before the count gets changed */
+static void host_timer_sync()
+{
+    uint64_t period = 256 * HOST_TIMER_TICK;
+    if (tmr_on && (now - tmr_base) / period != (tmr_seen - tmr_base) / period)
+        tmr_tov = 1;
+    tmr_seen = now;
+}
+
+static uint8_t host_timer_count()
+{
+    return tmr_on ? (uint8_t)((now - tmr_base) / HOST_TIMER_TICK) : tmr_count;
+}
+
+/* events */
+
+static uint64_t host_next_event()
+{
+    uint64_t t = host_timer_compare_at();
+    if (master_wake < t)
+        t = master_wake;
+    if (eeprom_irq && eeprom_ready > now && eeprom_ready < t)
+        t = eeprom_ready;
+    if (adc_ready < t)
+        t = adc_ready;
+    if (master_done != NEVER && master_done + HOST_RUNOUT < t)
+        t = master_done + HOST_RUNOUT;
+    return t;
+}
+
+/* serve pending interrupts, returns the clocks they took */
+static uint64_t host_dispatch()
+{
+    uint64_t t0 = now;
+    while (SREG & SREG_I) {
+        void (*isr)(void);
+        if (pcif) {
+            pcif = 0;
+            isr = OWPCINT_vect;
+        } else if (ocf && tmr_irq) {
+            ocf = 0;
+            isr = OWTIMER_COMPA_vect;
+        } else if (eeprom_irq && now >= eeprom_ready) {
+            isr = OWEE_READY_vect; /* level triggered */
+        } else if (adc_flag && adc_irq) {
+            adc_flag = 0;
+            isr = ADC_vect;
+        } else
+            break;
+        SREG &= ~SREG_I;
+        ++irqs;
+        now += HOST_CLK_IRQ;
+        isr();
+        SREG |= SREG_I;
+    }
+    return now - t0;
+}
+
+static uint64_t host_events()
+{
+    uint64_t t;
+    if (master_wake <= now) {
+        swapcontext(&slave_ctx, &master_ctx);
+        host_bus_changed();
+    }
+    t = host_timer_compare_at();
+    if (t <= now) {
+        host_timer_sync();
+        tmr_seen = t;
+        ocf = 1;
+    }
+    if (adc_ready <= now) {
+        uint32_t v;
+        adc_noise = adc_noise * 1103515245 + 12345;
+        v = ((uint32_t)adc_input[adc_mux] * 1024 + (adc_noise >> 16)) >> 16;
+        adc_result = v > 1023 ? 1023 : v;
+        adc_flag = 1;
+        adc_ready = NEVER;
+    }
+    if (master_done != NEVER && now >= master_done + HOST_RUNOUT)
+        host_exit();
+    return host_dispatch();
+}
+
+/* run the rest of the world for the clocks an instruction sequence takes */
+static void host_advance(uint64_t clocks)
+{
+    uint64_t end = now + clocks;
+    for (;;) {
+        uint64_t t = host_next_event();
+        if (t > end)
+            break;
+        if (t > now)
+            now = t;
+        end += host_events(); /* interrupts delay the interrupted code */
+    }
+    now = end;
+    end += host_events();
+    now = end;
+}
+
+/* HAL */
+
+void ows_pull_bus_down()
+{
+    host_advance(HOST_CLK_IO);
+    if (master_low && !slave_low && now - master_fall > response)
+        response = now - master_fall;
+    slave_low = 1;
+    host_bus_changed();
+}
+
+void ows_release_bus()
+{
+    host_advance(HOST_CLK_IO);
+    slave_low = 0;
+    host_bus_changed();
+}
+
+uint8_t ows_read_bus()
+{
+    host_advance(HOST_CLK_READ);
+    return host_bus();
+}
+
+void ows_hal_setup()
+{
+    host_advance(3 * HOST_CLK_IO);
+}
+
+void ows_hal_pcint_enable()
+{
+    host_advance(HOST_CLK_IO);
+    pcint_on = 1;
+}
+
+void ows_hal_pcint_disable()
+{
+    host_advance(HOST_CLK_IO);
+    pcint_on = 0;
+}
+
+void ows_hal_sleep()
+{
+    ows_host_sleep();
+}
+
+void ows_hal_timer_start()
+{
+    host_advance(3 * HOST_CLK_IO);
+    host_timer_sync();
+    if (!tmr_on)
+        tmr_base = now - (uint64_t)tmr_count * HOST_TIMER_TICK;
+    tmr_on = 1;
+    tmr_irq = 0;
+}
+
+void ows_hal_timer_stop()
+{
+    host_advance(HOST_CLK_IO);
+    host_timer_sync();
+    tmr_count = host_timer_count();
+    tmr_on = 0;
+}
+
+uint8_t ows_hal_timer_read()
+{
+    host_advance(HOST_CLK_IO);
+    return host_timer_count();
+}
+
+void ows_hal_timer_clear()
+{
+    host_advance(HOST_CLK_IO);
+    host_timer_sync();
+    tmr_base = now;
+    tmr_count = 0;
+}
+
+uint8_t ows_hal_timer_overflow()
+{
+    host_advance(HOST_CLK_IO);
+    host_timer_sync();
+    return tmr_tov;
+}
+
+void ows_hal_timer_clear_flags()
+{
+    host_advance(HOST_CLK_IO);
+    host_timer_sync();
+    tmr_tov = 0;
+    ocf = 0;
+}
+
+void ows_hal_timer_compare(uint8_t count)
+{
+    host_advance(HOST_CLK_IO);
+    host_timer_sync();
+    tmr_ocr = count;
+}
+
+void ows_hal_timer_irq_enable()
+{
+    host_advance(HOST_CLK_IO);
+    host_timer_sync();
+    tmr_irq = 1;
+}
+
+void ows_hal_timer_irq_disable()
+{
+    host_advance(HOST_CLK_IO);
+    tmr_irq = 0;
+}
+
+uint8_t ows_hal_eeprom_busy()
+{
+    host_advance(HOST_CLK_IO);
+    return now < eeprom_ready;
+}
+
+void ows_hal_eeprom_write(uint16_t addr, uint8_t data)
+{
+    host_advance(4 * HOST_CLK_IO);
+    eeprom[addr & E2END] = data;
+    eeprom_ready = now + HOST_EEPROM_WRITE;
+}
+
+void ows_hal_eeprom_irq_enable()
+{
+    host_advance(HOST_CLK_IO);
+    eeprom_irq = 1;
+}
+
+void ows_hal_eeprom_irq_disable()
+{
+    host_advance(HOST_CLK_IO);
+    eeprom_irq = 0;
+}
+
+void ows_hal_delay4(uint16_t loops)
+{
+    host_advance(4 * (loops ? loops : 0x10000L));
+}
+
+void ows_hal_delay3(uint8_t loops)
+{
+    host_advance(3 * (loops ? loops : 0x100));
+}
+
+/* ds2450_hal.h */
+
+void ds2450_hal_adc_setup()
+{
+    host_advance(4 * HOST_CLK_IO);
+}
+
+void ds2450_hal_adc_start(uint8_t channel)
+{
+    host_advance(3 * HOST_CLK_IO);
+    adc_mux = channel & 7;
+    if (adc_ready == NEVER)
+        adc_ready = now + HOST_ADC_CONVERSION;
+}
+
+uint8_t ds2450_hal_adc_busy()
+{
+    host_advance(HOST_CLK_IO);
+    return adc_ready != NEVER;
+}
+
+uint8_t ds2450_hal_adc_done()
+{
+    host_advance(HOST_CLK_IO);
+    return adc_flag;
+}
+
+void ds2450_hal_adc_clear()
+{
+    host_advance(HOST_CLK_IO);
+    adc_flag = 0;
+}
+
+uint16_t ds2450_hal_adc_read()
+{
+    host_advance(2 * HOST_CLK_IO);
+    return adc_result;
+}
+
+void ds2450_hal_adc_irq_enable()
+{
+    host_advance(3 * HOST_CLK_IO);
+    adc_irq = 1;
+}
+
+void ds2450_hal_adc_irq_disable()
+{
+    host_advance(3 * HOST_CLK_IO);
+    adc_irq = 0;
+}
+
+/* avr/interrupt.h, avr/sleep.h */
+
+void ows_host_sei(void)
+{
+    SREG |= SREG_I; /* pending interrupts are served after the next instruction */
+}
+
+void ows_host_cli(void)
+{
+    SREG &= ~SREG_I;
+}
+
+void ows_host_sleep(void)
+{
+    unsigned long n = irqs;
+    for (;;) {
+        uint64_t t;
+        host_events();
+        if (irqs != n)
+            return;
+        t = host_next_event();
+        if (t == NEVER)
+            host_exit(); /* nothing will ever wake us up */
+        if (t > now) {
+            asleep += t - now;
+            now = t;
+        }
+    }
+}
+
+/* avr/eeprom.h */
+
+uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+    eeprom_busy_wait();
+    host_advance(4);
+    return eeprom[(uintptr_t)addr & E2END];
+}
+
+void eeprom_write_byte(uint8_t *addr, uint8_t value)
+{
+    eeprom_busy_wait();
+    host_advance(4);
+    eeprom[(uintptr_t)addr & E2END] = value;
+    eeprom_ready = now + HOST_EEPROM_WRITE;
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        ((uint8_t*)dst)[i] = eeprom_read_byte((const uint8_t*)src + i);
+}
+
+void eeprom_write_block(const void *src, void *dst, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        eeprom_write_byte((uint8_t*)dst + i, ((const uint8_t*)src)[i]);
+}
+
+int eeprom_is_ready(void)
+{
+    host_advance(HOST_CLK_IO);
+    return now >= eeprom_ready;
+}
+
+void eeprom_busy_wait(void)
+{
+    while (!eeprom_is_ready())
+        ;
+}
+
+/* avr/boot.h, avr/pgmspace.h */
+
+void boot_page_fill(uint16_t addr, uint16_t w)
+{
+    host_advance(4);
+    spm_buffer[addr % SPM_PAGESIZE / 2] = w;
+}
+
+void boot_page_erase(uint16_t addr)
+{
+    host_advance(HOST_SPM);
+    memset(flash + (addr & FLASHEND & ~(SPM_PAGESIZE - 1)), 0xFF, SPM_PAGESIZE);
+}
+
+/* the buffer is programmed into the page (only clears bits) and erased */
+void boot_page_write(uint16_t addr)
+{
+    uint8_t *page = flash + (addr & FLASHEND & ~(SPM_PAGESIZE - 1));
+    host_advance(HOST_SPM);
+    for (int i = 0; i < SPM_PAGESIZE / 2; ++i) {
+        page[2 * i] &= spm_buffer[i];
+        page[2 * i + 1] &= spm_buffer[i] >> 8;
+    }
+    memset(spm_buffer, 0xFF, sizeof(spm_buffer));
+}
+
+uint8_t ows_host_flash_read(uint16_t addr)
+{
+    host_advance(3);
+    return flash[addr & FLASHEND];
+}
+
+/* ows_host.h */
+
+void ows_host_jump(uint16_t addr)
+{
+    if (addr) {
+        fprintf(stderr, "jump to %04X: nothing to run there\n", addr);
+        host_exit();
+    }
+    longjmp(host_restart, 1);
+}
+
+/* ow_master.h */
+
+void ow_master_drive(uint8_t low)
+{
+    if (low && !master_low)
+        master_fall = now;
+    master_low = low;
+    host_bus_changed();
+}
+
+uint8_t ow_master_sample(void)
+{
+    return host_bus();
+}
+
+void ow_master_delay(uint32_t ns)
+{
+    master_wake = now + ((uint64_t)ns * CLK_FREQ + 999999) / 1000000;
+    swapcontext(&master_ctx, &slave_ctx);
+}
+
+uint64_t ow_master_time(void)
+{
+    return now * 1000000 / CLK_FREQ;
+}
+
+uint64_t ow_master_cycles(void)
+{
+    return now - asleep;
+}
+
+uint32_t ow_master_response(void)
+{
+    uint32_t r = response * 1000000 / CLK_FREQ;
+    response = 0;
+    return r;
+}
+
+static void host_master()
+{
+    ow_master_delay(1000000); /* let the slave boot */
+#ifdef OWS_HOST_MASTER
+    failures = ows_host_master(master_argc, master_argv);
+#else
+    failures = ow_master_run(script, NULL, stdout);
+#endif
+    fflush(stdout);
+    master_done = now;
+    master_wake = NEVER;
+    swapcontext(&master_ctx, &slave_ctx);
+}
+
+#ifndef OWS_HOST_MASTER
+static char *host_read_file(const char *name)
+{
+    FILE *f = strcmp(name, "-") ? fopen(name, "r") : stdin;
+    char *buf = NULL;
+    size_t len = 0, size = 0;
+
+    if (!f) {
+        perror(name);
+        exit(255);
+    }
+    do {
+        if (len + 1 >= size)
+            buf = realloc(buf, size += 4096);
+        len += fread(buf + len, 1, size - len - 1, f);
+    } while (!feof(f) && !ferror(f));
+    buf[len] = 0;
+    if (f != stdin)
+        fclose(f);
+    return buf;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    const char *eeprom_file = NULL, *flash_file = NULL;
+    FILE *f;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "E:F:A:c:")) != -1)
+        switch (opt) {
+            case 'E':
+                eeprom_file = optarg;
+                break;
+            case 'F':
+                flash_file = optarg;
+                break;
+            case 'A':
+                for (int i = 0; i < 8 && *optarg; ++i) {
+                    char *end;
+                    adc_input[i] = strtoul(optarg, &end, 16);
+                    optarg = *end ? end + 1 : end;
+                }
+                break;
+            case 'c':
+                script = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-E eeprom.bin] [-F flash.bin] [-A a,b,c,d] [-c 'script' | script-file]\n", argv[0]);
+                return 255;
+        }
+#ifdef OWS_HOST_MASTER
+    master_argc = argc - optind;
+    master_argv = argv + optind;
+#else
+    if (!script)
+        script = host_read_file(optind < argc ? argv[optind] : "-");
+#endif
+
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    if (eeprom_file && (f = fopen(eeprom_file, "rb"))) {
+        if (fread(eeprom, 1, sizeof(eeprom), f) == 0)
+            fprintf(stderr, "%s: empty EEPROM image\n", eeprom_file);
+        fclose(f);
+    }
+    memset(flash, 0xFF, sizeof(flash));
+    memset(spm_buffer, 0xFF, sizeof(spm_buffer));
+    if (flash_file && (f = fopen(flash_file, "rb"))) {
+        if (fread(flash, 1, sizeof(flash), f) == 0)
+            fprintf(stderr, "%s: empty flash image\n", flash_file);
+        fclose(f);
+    }
+
+    master_done = NEVER;
+    getcontext(&master_ctx);
+    master_ctx.uc_stack.ss_sp = malloc(HOST_MASTER_STACK);
+    master_ctx.uc_stack.ss_size = HOST_MASTER_STACK;
+    master_ctx.uc_link = NULL;
+    makecontext(&master_ctx, host_master, 0);
+
+    if (!setjmp(host_done)) {
+        setjmp(host_restart);
+        SREG = 0;
+        ows_device_main();
+    }
+
+    if (eeprom_file && (f = fopen(eeprom_file, "wb"))) {
+        fwrite(eeprom, 1, sizeof(eeprom), f);
+        fclose(f);
+    }
+    if (flash_file && (f = fopen(flash_file, "wb"))) {
+        fwrite(flash, 1, sizeof(flash), f);
+        fclose(f);
+    }
+    if (master_done == NEVER) {
+        fprintf(stderr, "slave stopped before the end of the script\n");
+        return 255;
+    }
+    return failures;
+}
+
+/*
+ vim: ts=4 sw=4 sts=4 et
+*/
@@ -0,0 +1,20 @@
+#ifndef OWS_HOST_H_INCLUDED
+#define OWS_HOST_H_INCLUDED
+
+/* simulator hooks behind the host avr/ headers, see ows_host.c */
+
+#include <stdint.h>
+
+void ows_host_sei(void);
+void ows_host_cli(void);
+void ows_host_sleep(void);
+void ows_host_jump(uint16_t addr); /* ows_spm.c, 0xC3 */
+
+/* with OWS_HOST_MASTER, runs as the master instead of a script */
+int ows_host_master(int argc, char *argv[]);
+
+#endif /* OWS_HOST_H_INCLUDED */
+
+/*
+ vim: ts=4 sw=4 sts=4 et
+*/
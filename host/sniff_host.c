@@ -0,0 +1,639 @@
+/*
+ * Host backend of sniff_hal.h: the sniffer firmware runs natively and
+ * listens to a simulated bus, where the scripted master of ow_master.c
+ * talks to one slave (family 28, a 9 byte scratchpad behind BE).
+ *
+ * Time is counted in CPU clocks of the simulated ATMega168 and, as in
+ * ows_host.c, only passes in the HAL calls of the firmware. The master
+ * runs in a coroutine. Pin change and timer 1 overflow interrupts are
+ * dispatched between the HAL calls; an interrupt is charged for its
+ * response, register saves and reti on top of the HAL calls it makes.
+ * What the sniffer sends at 1Mbaud is decoded and printed, one line per
+ * record (data bytes run together) with the time it refers to in uS:
+ *   sniff  RESET low_us  t_us
+ *
+ * usage: sniff_host [-n slaves] [-C] [-c 'script' | script-file]
+ * -n 0 leaves the bus without a slave, -C makes the PC send 'C' first
+ * (bursts captured at standard speed too). See ow_master.h for the
+ * script. Exits with the number of failed commands plus lost edges.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include "sniff_hal.h"
+#include "ow_master.h"
+#include "ow_crc8.h"
+
+#define HOST_CLK_READ 7     /* bus poll: one iteration of the polling loops */
+#define HOST_CLK_IO 2       /* in/out */
+#define HOST_CLK_IRQ 48     /* response, the registers an ISR calling functions saves, reti */
+#define HOST_TIMER_TICK 8   /* timer 1 prescaler */
+#define HOST_TIMER_PERIOD (0x10000L * HOST_TIMER_TICK)
+#define HOST_RUNOUT (100L * CLK_FREQ) /* sniffer keeps running 100mS after the script */
+#define HOST_MASTER_STACK (256 * 1024)
+#define US(t) ((uint64_t)(t) * CLK_FREQ / 1000)
+#define NEVER UINT64_MAX
+
+int ows_device_main(); /* main() of sniff.c */
+void OWPCINT_vect(void);
+void TIMER1_OVF_vect(void);
+
+static uint64_t now;        /* CPU clocks since start */
+static uint8_t irq_on;      /* global interrupt flag */
+static unsigned long irqs;  /* interrupts served */
+static jmp_buf host_done;
+
+static ucontext_t sniffer_ctx, master_ctx;
+static uint64_t master_wake;
+static uint64_t master_done; /* script end, NEVER while running */
+static const char *script;
+static int failures;
+
+/* the bus */
+enum {
+    SLAVE_IDLE,
+    SLAVE_ROM,
+    SLAVE_MATCH,
+    SLAVE_SEARCH,
+    SLAVE_FUNC,
+    SLAVE_SEND,
+};
+
+static struct host_slave {
+    uint8_t rom[8];
+    uint8_t scratchpad[9];
+    uint8_t od, state, after;
+    uint8_t rx, out[9], out_len;
+    uint16_t bit;
+    uint64_t low_from, low_until; /* the slave holds the bus */
+} slave;
+static int nslaves = 1;
+static uint8_t master_low;
+static uint64_t master_fall;
+static uint8_t bus_seen = 1, pcint_on, pcif;
+
+/* timer 1 */
+static uint8_t tmr_on, tmr_irq, tov;
+static uint64_t tmr_seen;   /* overflows up to here are known */
+
+/* USART0: what the sniffer sends, decoded by the PC */
+static uint16_t uart_bit;
+static uint8_t tx_buf, tx_full, tx_shift;
+static uint64_t tx_done = NEVER;
+static uint8_t rx_c, rx_n;
+static uint8_t pc_rec[16], pc_rec_len;
+static char pc_data[3 * 256 + 1];
+static uint64_t pc_data_at;
+static unsigned long records, lost;
+
+void __attribute__((weak)) TIMER1_OVF_vect(void) { }
+
+static void host_exit()
+{
+    longjmp(host_done, 1);
+}
+
+/* slave */
+
+static uint8_t slave_bit(const uint8_t *buf, uint16_t bit)
+{
+    return (buf[bit >> 3] >> (bit & 7)) & 1;
+}
+
+static void slave_send(struct host_slave *s, const uint8_t *buf, uint8_t len, uint8_t after)
+{
+    memcpy(s->out, buf, len);
+    s->out_len = len;
+    s->after = after;
+    s->state = SLAVE_SEND;
+    s->bit = 0;
+}
+
+static void slave_byte(struct host_slave *s, uint8_t b)
+{
+    s->bit = 0;
+    if (s->state == SLAVE_ROM) {
+        switch (b) {
+            case 0x33: slave_send(s, s->rom, 8, SLAVE_FUNC); break;
+            case 0x55: s->state = SLAVE_MATCH; break;
+            case 0xCC: s->state = SLAVE_FUNC; break;
+            case 0xF0: s->state = SLAVE_SEARCH; break;
+            case 0x3C: s->od = 1; s->state = SLAVE_FUNC; break;
+            case 0x69: s->od = 1; s->state = SLAVE_MATCH; break;
+            default: s->state = SLAVE_IDLE; break;
+        }
+    } else if (b == 0xBE)
+        slave_send(s, s->scratchpad, 9, SLAVE_IDLE);
+    else
+        s->state = SLAVE_FUNC;
+}
+
+static void slave_fall(struct host_slave *s)
+{
+    uint8_t b = 1;
+    if (s->state == SLAVE_SEND)
+        b = slave_bit(s->out, s->bit);
+    else if (s->state == SLAVE_SEARCH && s->bit % 3 != 2)
+        b = slave_bit(s->rom, s->bit / 3) ^ (s->bit % 3);
+    if (!b) {
+        s->low_from = now;
+        s->low_until = now + (s->od ? US(3) : US(30));
+    }
+}
+
+static void slave_rise(struct host_slave *s, uint64_t low)
+{
+    uint8_t b = low < (s->od ? US(2) : US(15));
+
+    if (low >= US(400) || (s->od && low >= US(48))) {
+        if (low >= US(400))
+            s->od = 0;
+        s->state = SLAVE_ROM;
+        s->bit = 0;
+        s->low_from = now + (s->od ? US(3) : US(30));
+        s->low_until = now + (s->od ? US(13) : US(150));
+        return;
+    }
+    switch (s->state) {
+        case SLAVE_ROM:
+        case SLAVE_FUNC:
+            s->rx = (s->rx >> 1) | (b << 7);
+            if (++s->bit == 8)
+                slave_byte(s, s->rx);
+            break;
+        case SLAVE_MATCH:
+            if (b != slave_bit(s->rom, s->bit)) {
+                s->od = 0;
+                s->state = SLAVE_IDLE;
+            } else if (++s->bit == 64) {
+                s->state = SLAVE_FUNC;
+                s->bit = 0;
+            }
+            break;
+        case SLAVE_SEARCH:
+            if (s->bit % 3 == 2 && b != slave_bit(s->rom, s->bit / 3))
+                s->state = SLAVE_IDLE;
+            else if (++s->bit == 3 * 64) {
+                s->state = SLAVE_FUNC;
+                s->bit = 0;
+            }
+            break;
+        case SLAVE_SEND:
+            if (++s->bit == 8 * s->out_len) {
+                s->state = s->after;
+                s->bit = 0;
+            }
+            break;
+    }
+}
+
+static void host_slave_setup()
+{
+    static const uint8_t rom[7] = { 0x28, 0xC8, 0xBE, 0x1C, 0x89, 0x70, 0x5F };
+    static const uint8_t scratchpad[8] = { 0x90, 0x01, 0x4B, 0x46, 0x7F, 0xFF, 0x0C, 0x10 };
+    memcpy(slave.rom, rom, 7);
+    slave.rom[7] = 0;
+    for (int k = 0; k < 7; ++k)
+        slave.rom[7] = ow_crc8_update(slave.rom[7], rom[k]);
+    memcpy(slave.scratchpad, scratchpad, 8);
+    slave.scratchpad[8] = 0;
+    for (int k = 0; k < 8; ++k)
+        slave.scratchpad[8] = ow_crc8_update(slave.scratchpad[8], scratchpad[k]);
+}
+
+static uint8_t host_bus()
+{
+    if (master_low)
+        return 0;
+    return !(nslaves && slave.low_from <= now && now < slave.low_until);
+}
+
+static void host_bus_changed()
+{
+    uint8_t b = host_bus();
+    if (b != bus_seen) {
+        bus_seen = b;
+        if (pcint_on)
+            pcif = 1;
+    }
+}
+
+/* timer 1 */
+
+static void host_timer_sync()
+{
+    if (tmr_on && now / HOST_TIMER_PERIOD != tmr_seen / HOST_TIMER_PERIOD)
+        tov = 1;
+    tmr_seen = now;
+}
+
+static uint64_t host_timer_overflow_at()
+{
+    if (!tmr_on || !tmr_irq || tov)
+        return NEVER;
+    return (tmr_seen / HOST_TIMER_PERIOD + 1) * HOST_TIMER_PERIOD;
+}
+
+/* the PC */
+
+static void host_pc_data_flush()
+{
+    if (!pc_data[0])
+        return;
+    printf("sniff\tDATA %s\t%.1f\n", pc_data, pc_data_at * 1000.0 / CLK_FREQ);
+    pc_data[0] = 0;
+}
+
+static double host_ticks_us(uint32_t ticks)
+{
+    return ticks * HOST_TIMER_TICK * 1000.0 / CLK_FREQ;
+}
+
+static void host_pc_record()
+{
+    uint8_t *p = pc_rec + 1, len = pc_rec[0] & 0x0F;
+    uint16_t w = p[0] | p[1] << 8;
+    ++records;
+    if (pc_rec[0] >> 4 == 4) {
+        size_t n = strlen(pc_data);
+        if (!n)
+            pc_data_at = now;
+        if (n + 3 < sizeof(pc_data))
+            sprintf(pc_data + n, "%s%02X", n ? " " : "", p[0]);
+        return;
+    }
+    host_pc_data_flush();
+    printf("sniff\t");
+    switch (pc_rec[0] >> 4) {
+        case 1:
+            printf("RESET %.1f\t%.1f\n", host_ticks_us(p[4] | p[5] << 8),
+                host_ticks_us(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24));
+            return;
+        case 2:
+            printf("PRESENCE %.1f", host_ticks_us(w));
+            break;
+        case 3:
+            printf("ROM %02X", p[0]);
+            if (len == 9) {
+                printf(" ");
+                for (int i = 1; i < 9; ++i)
+                    printf("%02X", p[i]);
+            }
+            break;
+        case 5:
+            printf("BITS %u %02X", p[0], p[1]);
+            break;
+        case 6:
+            printf("LOST %u", p[0]);
+            lost += p[0];
+            break;
+        case 7:
+            printf("CAPTURE %u", w);
+            break;
+        default:
+            printf("? %02X", pc_rec[0]);
+            break;
+    }
+    printf("\t%.1f\n", now * 1000.0 / CLK_FREQ);
+}
+
+static void host_pc_receive(uint8_t c)
+{
+    pc_rec[pc_rec_len++] = c;
+    if (pc_rec_len == 1 + (pc_rec[0] & 0x0F)) {
+        host_pc_record();
+        pc_rec_len = 0;
+    }
+}
+
+static void host_uart_shift(uint8_t c)
+{
+    tx_shift = c;
+    tx_done = now + 10 * uart_bit;
+}
+
+/* events */
+
+static uint64_t host_next_event()
+{
+    uint64_t t = master_wake;
+    if (nslaves && slave.low_from > now && slave.low_from < t)
+        t = slave.low_from;
+    if (nslaves && slave.low_until > now && slave.low_until < t)
+        t = slave.low_until;
+    if (host_timer_overflow_at() < t)
+        t = host_timer_overflow_at();
+    if (tx_done < t)
+        t = tx_done;
+    if (master_done != NEVER && master_done + HOST_RUNOUT < t)
+        t = master_done + HOST_RUNOUT;
+    return t;
+}
+
+static void host_advance(uint64_t clocks);
+
+/* serve pending interrupts, returns the clocks they took */
+static uint64_t host_dispatch()
+{
+    uint64_t t0 = now;
+    while (irq_on) {
+        void (*isr)(void);
+        host_timer_sync();
+        if (pcif) {
+            pcif = 0;
+            isr = OWPCINT_vect;
+        } else if (tov && tmr_irq) {
+            tov = 0;
+            isr = TIMER1_OVF_vect;
+        } else
+            break;
+        irq_on = 0;
+        ++irqs;
+        host_advance(HOST_CLK_IRQ); /* the master doesn't wait for it */
+        isr();
+        irq_on = 1;
+    }
+    return now - t0;
+}
+
+static uint64_t host_events()
+{
+    if (master_wake <= now)
+        swapcontext(&sniffer_ctx, &master_ctx);
+    host_bus_changed();
+    host_timer_sync();
+    if (tx_done <= now) {
+        host_pc_receive(tx_shift);
+        tx_done = NEVER;
+        if (tx_full) {
+            tx_full = 0;
+            host_uart_shift(tx_buf);
+        }
+    }
+    if (master_done != NEVER && now >= master_done + HOST_RUNOUT)
+        host_exit();
+    return host_dispatch();
+}
+
+/* run the rest of the world for the clocks an instruction sequence takes */
+static void host_advance(uint64_t clocks)
+{
+    uint64_t end = now + clocks;
+    for (;;) {
+        uint64_t t = host_next_event();
+        if (t > end)
+            break;
+        if (t > now)
+            now = t;
+        end += host_events(); /* interrupts delay the interrupted code */
+    }
+    now = end;
+    end += host_events();
+    now = end;
+}
+
+/* ows_hal.h, the parts the sniffer uses */
+
+uint8_t ows_read_bus()
+{
+    host_advance(HOST_CLK_READ);
+    return host_bus();
+}
+
+void ows_hal_setup()
+{
+    host_advance(3 * HOST_CLK_IO);
+}
+
+void ows_hal_pcint_enable()
+{
+    host_advance(HOST_CLK_IO);
+    bus_seen = host_bus();
+    pcint_on = 1;
+}
+
+/* sniff_hal.h */
+
+void sniff_hal_uart_setup(uint16_t ubrr)
+{
+    host_advance(6 * HOST_CLK_IO);
+    uart_bit = 8 * (ubrr + 1); /* U2X0 */
+}
+
+uint8_t sniff_hal_uart_ready()
+{
+    host_advance(HOST_CLK_IO);
+    return !tx_full;
+}
+
+void sniff_hal_uart_write(uint8_t c)
+{
+    host_advance(HOST_CLK_IO);
+    if (tx_done == NEVER)
+        host_uart_shift(c);
+    else {
+        tx_buf = c;
+        tx_full = 1;
+    }
+}
+
+uint8_t sniff_hal_uart_received()
+{
+    host_advance(HOST_CLK_IO);
+    return rx_n;
+}
+
+uint8_t sniff_hal_uart_read()
+{
+    host_advance(HOST_CLK_IO);
+    rx_n = 0;
+    return rx_c;
+}
+
+void sniff_hal_timer_start()
+{
+    host_advance(5 * HOST_CLK_IO);
+    tmr_on = 1;
+    tmr_irq = 1;
+    tov = 0;
+    tmr_seen = now;
+}
+
+uint16_t sniff_hal_timer_read()
+{
+    host_advance(HOST_CLK_IO);
+    return now / HOST_TIMER_TICK;
+}
+
+uint8_t sniff_hal_timer_read8()
+{
+    host_advance(HOST_CLK_IO);
+    return now / HOST_TIMER_TICK;
+}
+
+uint8_t sniff_hal_timer_overflow()
+{
+    host_advance(HOST_CLK_IO);
+    host_timer_sync();
+    return tov;
+}
+
+void sniff_hal_timer_clear_overflow()
+{
+    host_advance(HOST_CLK_IO);
+    host_timer_sync();
+    tov = 0;
+}
+
+void sniff_hal_pcint_clear()
+{
+    host_advance(HOST_CLK_IO);
+    pcif = 0;
+}
+
+/* avr/interrupt.h, avr/sleep.h */
+
+void ows_host_sei(void)
+{
+    irq_on = 1;
+}
+
+void ows_host_cli(void)
+{
+    irq_on = 0;
+}
+
+void ows_host_sleep(void)
+{
+    host_advance(1);
+}
+
+/* ow_master.h */
+
+void ow_master_drive(uint8_t low)
+{
+    if (low && !master_low) {
+        master_low = 1;
+        master_fall = now;
+        if (nslaves)
+            slave_fall(&slave);
+    } else if (!low && master_low) {
+        master_low = 0;
+        if (nslaves)
+            slave_rise(&slave, now - master_fall);
+    }
+    host_bus_changed();
+}
+
+uint8_t ow_master_sample(void)
+{
+    return host_bus();
+}
+
+void ow_master_delay(uint32_t ns)
+{
+    master_wake = now + ((uint64_t)ns * CLK_FREQ + 999999) / 1000000;
+    swapcontext(&master_ctx, &sniffer_ctx);
+}
+
+uint64_t ow_master_time(void)
+{
+    return now * 1000000 / CLK_FREQ;
+}
+
+uint64_t ow_master_cycles(void)
+{
+    return now;
+}
+
+uint32_t ow_master_response(void)
+{
+    return 0;
+}
+
+static void host_master()
+{
+    ow_master_delay(1000000); /* let the sniffer boot */
+    failures = ow_master_run(script, NULL, stdout);
+    fflush(stdout);
+    master_done = now;
+    master_wake = NEVER;
+    swapcontext(&master_ctx, &sniffer_ctx);
+}
+
+static char *host_read_file(const char *name)
+{
+    FILE *f = strcmp(name, "-") ? fopen(name, "r") : stdin;
+    char *buf = NULL;
+    size_t len = 0, size = 0;
+
+    if (!f) {
+        perror(name);
+        exit(255);
+    }
+    do {
+        if (len + 1 >= size)
+            buf = realloc(buf, size += 4096);
+        len += fread(buf + len, 1, size - len - 1, f);
+    } while (!feof(f) && !ferror(f));
+    buf[len] = 0;
+    if (f != stdin)
+        fclose(f);
+    return buf;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:Cc:")) != -1)
+        switch (opt) {
+            case 'n':
+                nslaves = atoi(optarg);
+                if (nslaves < 0 || nslaves > 1)
+                    goto usage;
+                break;
+            case 'C':
+                rx_c = 'C';
+                rx_n = 1;
+                break;
+            case 'c':
+                script = optarg;
+                break;
+            default:
+                goto usage;
+        }
+    if (!script)
+        script = host_read_file(optind < argc ? argv[optind] : "-");
+
+    host_slave_setup();
+    master_done = NEVER;
+    getcontext(&master_ctx);
+    master_ctx.uc_stack.ss_sp = malloc(HOST_MASTER_STACK);
+    master_ctx.uc_stack.ss_size = HOST_MASTER_STACK;
+    master_ctx.uc_link = NULL;
+    makecontext(&master_ctx, host_master, 0);
+
+    if (!setjmp(host_done))
+        ows_device_main();
+
+    host_pc_data_flush();
+    printf("# %lu records, %lu edges lost, %lu interrupts\n", records, lost, irqs);
+    if (master_done == NEVER) {
+        fprintf(stderr, "sniffer stopped before the end of the script\n");
+        return 255;
+    }
+    return failures + lost;
+
+usage:
+    fprintf(stderr, "usage: %s [-n slaves] [-C] [-c 'script' | script-file]\n", argv[0]);
+    return 255;
+}
+
+/*
+ vim: ts=4 sw=4 sts=4 et
+*/
@@ -1,3 +1,31 @@
-void ow_crc16_reset();
-void ow_crc16_update(uint8_t b);
-uint16_t ow_crc16_get();
+#ifndef OW_CRC16_H_INCLUDED
+#define OW_CRC16_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Dallas 1-wire CRC16 (X^16 + X^15 + X^2 + 1). Every running CRC has its
+ * own context, so e.g. a page CRC and a whole image CRC can be kept at once.
+ * Implementation is chosen at build time:
+ *   OW_CRC16_LOOP   - bit by bit, no table
+ *   OW_CRC16_NIBBLE - two lookups in a 16 word table
+ *   OW_CRC16_TABLE  - one lookup in a 256 word table
+ * Default is the full table on ATMega and the nibble table on ATTiny.
+ */
+#if !defined(OW_CRC16_LOOP) && !defined(OW_CRC16_NIBBLE) && !defined(OW_CRC16_TABLE)
+# if defined(__AVR_ATmega168__) || !defined(__AVR__)
+#  define OW_CRC16_TABLE
+# else
+#  define OW_CRC16_NIBBLE
+# endif
+#endif
+
+typedef struct {
+	uint16_t crc;
+} ow_crc16_t;
+
+void ow_crc16_reset(ow_crc16_t* ctx);
+void ow_crc16_update(ow_crc16_t* ctx, uint8_t b);
+uint16_t ow_crc16_get(const ow_crc16_t* ctx);
+
+#endif /* OW_CRC16_H_INCLUDED */
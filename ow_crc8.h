@@ -0,0 +1,25 @@
+#ifndef OW_CRC8_H_INCLUDED
+#define OW_CRC8_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Dallas 1-wire CRC8 (X^8 + X^5 + X^4 + 1), one byte at a time, so it can
+ * be folded in while the data is being sent or received.
+ * Implementation is chosen at build time:
+ *   OW_CRC8_LOOP   - bit by bit, no table
+ *   OW_CRC8_NIBBLE - two lookups in a 16 byte table
+ *   OW_CRC8_TABLE  - one lookup in a 256 byte table
+ * Default is the full table on ATMega and the nibble table on ATTiny.
+ */
+#if !defined(OW_CRC8_LOOP) && !defined(OW_CRC8_NIBBLE) && !defined(OW_CRC8_TABLE)
+# if defined(__AVR_ATmega168__) || !defined(__AVR__)
+#  define OW_CRC8_TABLE
+# else
+#  define OW_CRC8_NIBBLE
+# endif
+#endif
+
+uint8_t ow_crc8_update(uint8_t crc, uint8_t b);
+
+#endif /* OW_CRC8_H_INCLUDED */
@@ -1,21 +1,37 @@
 #include "ows.h"
+#include "ows_hal.h"
+#include "ow_crc8.h"
 
 #define TIMESLOT_WAIT_TIMEOUT 120
+#define TIMESLOT_WAIT_TIMEOUT_OD 24 /* overdrive slots are 16uS at most */
 // timer prescaler is 1/64
 #define uS_TO_TIMER_COUNTS(t) (((t) * CLK_FREQ) / 64 / 1000L)
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
 #include <avr/pgmspace.h>
-#include <avr/sleep.h>
 #include <avr/eeprom.h>
-#include <setjmp.h>
+#include "ows_eeprom.h"
+#ifndef OWS_ASYNC_ENABLE
+# ifdef OWS_ERRNO_ENABLE
+/*
+ * No setjmp: a failing function sets errno and returns, callers check it
+ * after every call that can fail. Saves the jmp_buf (23 bytes of RAM) and
+ * the register file save on every request.
+ */
+#  define OWS_RAISE(e, r) do { errno = (e); return r; } while (0)
+#  define OWS_CHECK(r) do { if (errno) return r; } while (0)
+# else
+#  include <setjmp.h>
 
 static jmp_buf err;
+#  define OWS_RAISE(e, r) longjmp(err, (e))
+#  define OWS_CHECK(r)
+# endif
+#endif
 
 struct {
     int rc:1; /* resume flag */
     int wait_reset:1;
+    int od:1; /* overdrive speed */
 } ows_flags;
 
 // ows private data
@@ -24,61 +40,51 @@ uint8_t errno;
 #ifdef OWS_WRITE_ROM_ENABLE
 uint16_t ows_eeprom_addr;
 #endif
+#ifdef OWS_MULTI_ENABLE
+uint8_t ows_selected;
+static uint8_t ows_multi_all;       /* a bit per instance */
+static uint8_t ows_multi_bits[64];  /* ROM bit n of instance i is bit i of [n] */
+#endif
+#ifdef OWS_WEAR_LEVEL_ENABLE
+static struct ows_record ows_rom_store = OWS_RECORD(OWS_ROM_STORE_BASE, OWS_APP_STORE_BASE - 1, 6);
+#endif
 #ifdef OWS_CONDSEARCH_ENABLE
 uint8_t ows_flag;
 # define OWS_FLAG_INTERRUPT_POSSIBLE 0x80
 #endif
 
-inline void ows_pull_bus_down()
-{
-    OWPORT(DDR) |= (OWMASK);    // drives output low
-}
-
-inline void ows_release_bus()
-{
-    OWPORT(DDR) &= ~(OWMASK);
-}
-
-inline uint8_t ows_read_bus()
-{
-    return (OWPORT(PIN) & OWMASK) ? 1 : 0;
-}
-
+#ifndef OWS_ASYNC_ENABLE
 static void ows_delay_15uS() // delayMicroseconds(15)
 {
     uint16_t us = (15L * CLK_FREQ) / 4L / 1000L;
     // account for the time taken in the preceeding commands.
     us -= 2 + 4 /* 4 for rcall */;
 
-    // busy wait
-    __asm__ __volatile__ (
-        "1: sbiw %0,1" "\n\t" // 2 cycles
-        "brne 1b" : "=w" (us) : "0" (us) // 2 cycles
-    );
+    ows_hal_delay4(us); // busy wait
 }
-inline void ows_delay_30uS() // delayMicroseconds(30)
+static inline void ows_delay_30uS() // delayMicroseconds(30)
 {
     ows_delay_15uS();
     ows_delay_15uS();
 }
 
+#ifdef OWS_OVERDRIVE_ENABLE
+// overdrive delays are a few uS: ows_hal_delay3() loops, 3 clocks each
+#define OD_LOOPS(t) ((uint8_t)(((t) * CLK_FREQ) / 3L / 1000L))
+#endif /* OWS_OVERDRIVE_ENABLE */
+#endif /* OWS_ASYNC_ENABLE */
+
 volatile int16_t ows_timestamp;
-inline void ows_timer_start(int16_t timeout)
+static inline void ows_timer_start(int16_t timeout)
 {
   ows_timestamp = timeout;
-  TCCR0A = 0x00; // Normal mode
-  TCCR0B = 0x03; // clk/64
-#ifdef TIMSK0
-  TIMSK0 &= ~(1<<OCIE0A | 1<<OCIE0B | 1<<TOIE0); // disable timer 0 interrupts
-#else
-  TIMSK &= ~(1<<OCIE0A | 1<<OCIE0B | 1<<TOIE0); // disable timer 0 interrupts
-#endif
-  TCNT0 = 0; // count register
+  ows_hal_timer_start(); // clk/64, interrupts disabled
+  ows_hal_timer_clear(); // count register
 }
 
-inline void ows_timer_stop()
+static inline void ows_timer_stop()
 {
-  TCCR0B = 0x00; // clk/64
+  ows_hal_timer_stop();
 }
 
 // 70 .. 540 uS --- Reset pulse
@@ -90,9 +96,9 @@ inline void ows_timer_stop()
 // 117.5 .. 135 counts @ 16MHz
 // 70.5 .. 81 counts @ 9.6MHz     ((540)/(1/9.6))/64
 
-inline int16_t ows_timer_read()
+static inline int16_t ows_timer_read()
 {
-  return ows_timestamp - TCNT0;
+  return ows_timestamp - ows_hal_timer_read();
 }
 
 /* === end platform-specific === */
@@ -101,35 +107,29 @@ uint8_t ows_crc8(char* data, uint8_t len)
 {
     uint8_t crc = 0;
 
-    while (len--) {
-        uint8_t inbyte = *data++;
-        for (uint8_t i = 8; i; i--) {
-            uint8_t mix = (crc ^ inbyte) & 0x01;
-            crc >>= 1;
-            if (mix) crc ^= 0x8C;
-            inbyte >>= 1;
-        }
-    }
+    while (len--)
+        crc = ow_crc8_update(crc, *data++);
     return crc;
 }
 
+#ifdef OWS_ASYNC_ENABLE
+static void ows_async_start();
+#endif
+
 void ows_setup(char * rom)
 {
     for (int i=0; i<7; i++)
         ows_rom[i] = rom[i];
     ows_rom[7] = ows_crc8(ows_rom, 7);
-    OWPORT(PORT) &= ~(OWMASK); /* We only need "0" - simulate open drain */
-#ifdef GIFR /* tiny45 */
-    GIMSK |= (1 << PCIE); /* enable pin change interrupts */
-#else
-    PCICR |= 0x07; /* enable all pin change interrupts */
-#endif
-    MCUCR = 1<<SE; /* sleep enable (idle mode) */
+    ows_hal_setup(); /* open drain bus pin, pin change interrupts, idle sleep */
 #ifdef OWS_CONDSEARCH_ENABLE
     ows_flag = 0;
 #endif
     *(uint8_t*)&ows_flags = 0;
     ows_flags.wait_reset = 1;
+#ifdef OWS_ASYNC_ENABLE
+    ows_async_start();
+#endif
 }
 
 void ows_setup2(uint8_t family, uint16_t eeprom_addr)
@@ -138,46 +138,142 @@ void ows_setup2(uint8_t family, uint16_t eeprom_addr)
 #ifdef OWS_WRITE_ROM_ENABLE
     ows_eeprom_addr = eeprom_addr;
 #endif
-    eeprom_read_block((void*)&ows_rom[1], (const void*)eeprom_addr, 6);
-    ows_rom[7] = ows_crc8(ows_rom, 7);
-    OWPORT(PORT) &= ~(OWMASK); /* We only need "0" - simulate open drain */
-#ifdef GIFR /* tiny45 */
-    GIMSK |= (1 << PCIE); /* enable pin change interrupts */
-#else
-    PCICR |= 0x07; /* enable all pin change interrupts */
+#ifdef OWS_WEAR_LEVEL_ENABLE
+    if (!ows_record_load(&ows_rom_store, &ows_rom[1]))
 #endif
-    MCUCR = 1<<SE; /* sleep enable (idle mode) */
+        eeprom_read_block((void*)&ows_rom[1], (const void*)eeprom_addr, 6);
+    ows_rom[7] = ows_crc8(ows_rom, 7);
+    ows_hal_setup(); /* open drain bus pin, pin change interrupts, idle sleep */
 #ifdef OWS_CONDSEARCH_ENABLE
     ows_flag = 0;
 #endif
     *(uint8_t*)&ows_flags = 0;
     ows_flags.wait_reset = 1;
+#ifdef OWS_ASYNC_ENABLE
+    ows_async_start();
+#endif
+}
+
+#ifdef OWS_MULTI_ENABLE
+void ows_setup_multi(char roms[][8], uint8_t n)
+{
+    for (uint8_t i = 0; i < n; ++i) {
+        roms[i][7] = ows_crc8(roms[i], 7);
+        for (uint8_t b = 0; b < 64; ++b)
+            if (roms[i][b >> 3] & (1 << (b & 7)))
+                ows_multi_bits[b] |= 1 << i;
+    }
+    ows_multi_all = (1 << n) - 1;
+    ows_selected = 0;
+    ows_hal_setup(); /* open drain bus pin, pin change interrupts, idle sleep */
+    *(uint8_t*)&ows_flags = 0;
+    ows_flags.wait_reset = 1;
+}
+#endif
+
+#ifdef OWS_WRITE_ROM_ENABLE
+# ifndef OWS_MULTI_ENABLE
+/* WRITE ROM (D5): an ID of our family with a valid CRC replaces ours, ours goes back */
+static void ows_write_rom()
+{
+    char addr[8];
+    uint8_t crc = 0;
+    for(uint8_t i = 0; i < 8; ++i) {
+        addr[i] = ows_recv();
+        crc = ow_crc8_update(crc, addr[i]); /* zero if addr[7] is valid crc */
+    }
+    if(errno)
+        return;
+    if(addr[0] == ows_rom[0] && crc == 0)
+    {
+#ifdef OWS_WEAR_LEVEL_ENABLE
+        ows_record_save(&ows_rom_store, &addr[1]);
+#else
+        ows_eeprom_write(ows_eeprom_addr, &addr[1], 6); /* queued, see ows_eeprom.h */
+#endif
+        for(uint8_t i = 0; i < 8; ++i)
+            ows_rom[i] = addr[i];
+    }
+    ows_send_data(ows_rom, 8);
 }
+# endif /* OWS_MULTI_ENABLE */
+
+/* EEPROM STATUS (D6): 00 while queued writes are pending, then FF */
+static void ows_eeprom_status()
+{
+    do {
+#ifdef OWS_ASYNC_ENABLE
+        cli(); /* the ISRs are live, EEPE within 4 clocks of EEMPE */
+        ows_eeprom_poll();
+        sei();
+#else
+        ows_eeprom_poll();
+#endif
+        ows_send(ows_eeprom_pending() ? 0x00 : 0xFF);
+    } while (!errno);
+}
+#endif /* OWS_WRITE_ROM_ENABLE */
 
+#ifndef OWS_ASYNC_ENABLE
 void ows_presence();
 void ows_in_reset();
 
+/*
+ * The pin change interrupt only wakes us up from sleep in ows_wait_reset().
+ * Without a handler the vector went to __bad_interrupt, i.e. restarted the
+ * firmware on every wake up and lost all RAM state.
+ */
+EMPTY_INTERRUPT(OWPCINT_vect);
+
 void ows_wait_reset() {
     if(errno != ONEWIRE_TOO_LONG_PULSE)
     {
         errno = ONEWIRE_NO_ERROR;
         ows_release_bus(); /* just in case */
-        OWPCMSK |= OWMASK; /* enable pin change interrupt here, global interrupts are still disabled */
+        ows_eeprom_poll(); /* the bus is idle, keep queued writes going */
+#ifdef OWS_OVERDRIVE_ENABLE
+        if(ows_flags.od) {
+            /* waking up takes longer than the whole overdrive reset: poll */
+            uint16_t retries = 0;
+            for(;;) {
+                uint8_t n;
+#ifdef OWS_IDLE_IRQ_ENABLE
+                sei(); /* a reset outlasts the slot timeout by more than they take */
+#endif
+                while(ows_read_bus())
+                    if(--retries == 0) { /* idle for tens of mS, let the application run */
+                        cli();
+                        OWS_RAISE(ONEWIRE_INTERRUPTED, );
+                    }
+#ifdef OWS_IDLE_IRQ_ENABLE
+                cli();
+#endif
+                n = (TIMESLOT_WAIT_TIMEOUT_OD * CLK_FREQ) / 7L / 1000L;
+                while(! ows_read_bus() && --n)
+                    ;
+                if(! n) /* longer than any time slot */
+                    break;
+            }
+            ows_in_reset();
+            return;
+        }
+#endif
+        ows_hal_pcint_enable(); /* enable pin change interrupt here, global interrupts are still disabled */
         if(ows_read_bus()) {
             sei();
-            sleep_cpu();
+            ows_hal_sleep();
             cli();
         }
-        OWPCMSK &= ~OWMASK; /* disable pin change interrupt here, global interrupts are still disabled */
+        ows_hal_pcint_disable(); /* disable pin change interrupt here, global interrupts are still disabled */
         if(ows_read_bus())
-            longjmp(err, ONEWIRE_INTERRUPTED);
+            OWS_RAISE(ONEWIRE_INTERRUPTED, );
     }
     ows_in_reset();
 }
 
 void ows_in_reset()
 {
-    /* if just woken up: it gets ~117uS to wake up tiny45! */
+    /* if just woken up: a few uS (restarting through reset took ~117uS on tiny45) */
     /* if from recv_bit: ~120uS alrealy passed */
     /* new experiment: ~170uS passed */
     ows_timer_start(uS_TO_TIMER_COUNTS(540 - 170 /* (120UL*8000UL/CLK_FREQ) */));
@@ -204,14 +300,33 @@ void ows_in_reset()
             }
         }
     }
+#ifdef OWS_OVERDRIVE_ENABLE
+    if (ows_flags.od) {
+        /* longer than a time slot but shorter than a standard reset */
+        if (ows_timer_read() > uS_TO_TIMER_COUNTS(70)) {
+            ows_hal_delay3(OD_LOOPS(3));
+            ows_presence();
+            return;
+        }
+        ows_flags.od = 0; /* standard reset: back to standard speed */
+    }
+#endif
     if (ows_timer_read() > uS_TO_TIMER_COUNTS(70))
-        longjmp(err, ONEWIRE_VERY_SHORT_RESET);
+        OWS_RAISE(ONEWIRE_VERY_SHORT_RESET, );
     ows_delay_30uS();
     ows_presence();
 }
 
 void ows_presence()
 {
+#ifdef OWS_OVERDRIVE_ENABLE
+    if (ows_flags.od) {
+        ows_pull_bus_down();
+        ows_hal_delay3(OD_LOOPS(12)); // 8..24uS
+        ows_release_bus();
+        return;
+    }
+#endif
     ows_pull_bus_down();
     // 120uS delay
     ows_delay_30uS();
@@ -224,7 +339,7 @@ void ows_presence()
     for(uint8_t t = 0; t < ((300 - 25)/30); ++t)
         ows_delay_30uS();
     if (! ows_read_bus())
-        longjmp(err, ONEWIRE_PRESENCE_LOW_ON_LINE);
+        OWS_RAISE(ONEWIRE_PRESENCE_LOW_ON_LINE, );
 #endif
 }
 
@@ -239,16 +354,26 @@ uint8_t ows_wait_time_slot()
     retries = TIMESLOT_WAIT_RETRY_COUNT; //shoud be 49uS, not 120
     while (! ows_read_bus())
         if (--retries == 0)
-            longjmp(err, ONEWIRE_TOO_LONG_PULSE);
+            OWS_RAISE(ONEWIRE_TOO_LONG_PULSE, 0);
 #if OWS_ENABLE_TIMESLOT_TIMEOUT
     retries = TIMESLOT_WAIT_RETRY_COUNT;
     while ( ows_read_bus())
         if (--retries == 0)
-            longjmp(err, ONEWIRE_TIMESLOT_TIMEOUT);
+            OWS_RAISE(ONEWIRE_TIMESLOT_TIMEOUT, 0);
     }
 #else
+# ifdef OWS_IDLE_IRQ_ENABLE
+    sei(); /* the application's interrupts delay our response by their length */
+    while (ows_read_bus()) {
+        cli(); /* the queue is the EE_READY interrupt's too, EEPE within 4 clocks */
+        ows_eeprom_poll();
+        sei();
+    }
+    cli();
+# else
     while (ows_read_bus())
-        ;
+        ows_eeprom_poll(); /* a few clocks unless a queued byte is due */
+# endif
 #endif /* OWS_ENABLE_TIMESLOT_TIMEOUT */
 #ifdef OWS_CONDSEARCH_ENABLE
     ows_flag &= ~OWS_FLAG_INTERRUPT_POSSIBLE;
@@ -257,10 +382,59 @@ uint8_t ows_wait_time_slot()
 #undef TIMESLOT_WAIT_RETRY_COUNT
 }
 
+#ifdef OWS_OVERDRIVE_ENABLE
+/*
+ * Overdrive slot is 6..16uS: master writes '1' with 1..2uS pulse and
+ * samples our bit 2uS after the falling edge, so all the work is done
+ * right in the polling loops without calling anything.
+ */
+static inline uint8_t ows_wait_release_od()
+{
+    uint8_t retries = (TIMESLOT_WAIT_TIMEOUT_OD * CLK_FREQ) / 7L / 1000L;
+    while (! ows_read_bus())
+        if (--retries == 0)
+            OWS_RAISE(ONEWIRE_TOO_LONG_PULSE, 0);
+    return 1;
+}
+
+static uint8_t ows_recv_bit_od()
+{
+    ows_release_bus();
+    if (!ows_wait_release_od())
+        return 0;
+    while (ows_read_bus())
+        ;
+    ows_hal_delay3(OD_LOOPS(3));
+    return ows_read_bus();
+}
+
+static void ows_send_bit_od(uint8_t v)
+{
+    ows_release_bus();
+    if (!ows_wait_release_od())
+        return;
+    if (v & 1) {
+        while (ows_read_bus())
+            ;
+    } else {
+        while (ows_read_bus())
+            ;
+        ows_pull_bus_down();
+        ows_hal_delay3(OD_LOOPS(3));
+        ows_release_bus();
+    }
+}
+#endif /* OWS_OVERDRIVE_ENABLE */
+
 uint8_t ows_recv_bit(void)
 {
     uint8_t r;
 
+    OWS_CHECK(0); /* the error sticks until the next request */
+#ifdef OWS_OVERDRIVE_ENABLE
+    if (ows_flags.od)
+        return ows_recv_bit_od();
+#endif
     ows_release_bus();
     if (!ows_wait_time_slot() )
         return 0;
@@ -280,6 +454,13 @@ uint8_t ows_recv()
 
 void ows_send_bit(uint8_t v)
 {
+    OWS_CHECK();
+#ifdef OWS_OVERDRIVE_ENABLE
+    if (ows_flags.od) {
+        ows_send_bit_od(v);
+        return;
+    }
+#endif
     ows_release_bus();
     if (!ows_wait_time_slot() )
         return;
@@ -299,12 +480,54 @@ void ows_send(uint8_t v)
         ows_send_bit((bitmask & v)?1:0);
 }
 
-void ows_send_data(const char buf[], uint8_t len)
+#ifdef OWS_MULTI_ENABLE
+/*
+ * Every instance still in the race answers: the bus shows the AND of their
+ * bits and of the complements, then the master's direction drops the ones
+ * that don't match. Whoever is left at the end is selected.
+ */
+uint8_t ows_search() {
+    uint8_t active = ows_multi_all;
+    ows_flags.rc = 0;
+    for (uint8_t n = 0; n < 64; ++n) {
+        uint8_t ones = ows_multi_bits[n];
+        ows_send_bit(!(active & ~ones)); /* 0 if anyone has a 0 */
+        ows_send_bit(!(active & ones));
+        if (ows_recv_bit())
+            active &= ones;
+        else
+            active &= ~ones;
+        OWS_CHECK(0);
+        if (!active)
+            return 0;
+    }
+    ows_selected = active;
+    ows_flags.rc = 1;
+    return 1;
+}
+
+/* 64 bits of MATCH ROM, narrowing down the instances as they come */
+static uint8_t ows_match()
 {
-    for (uint8_t i = 0; i < len; ++i)
-        ows_send(buf[i]);
+    uint8_t active = ows_multi_all;
+    for (uint8_t n = 0; n < 64; ++n) {
+        if (ows_recv_bit())
+            active &= ows_multi_bits[n];
+        else
+            active &= ~ows_multi_bits[n];
+    }
+    OWS_CHECK(0);
+    ows_selected = active;
+    return active != 0;
 }
 
+/* READ ROM is only meant for a single device, all instances talk at once */
+static void ows_send_rom()
+{
+    for (uint8_t n = 0; n < 64; ++n)
+        ows_send_bit((ows_multi_bits[n] & ows_multi_all) == ows_multi_all);
+}
+#else
 uint8_t ows_search() {
     uint8_t bitmask;
     uint8_t bit_send, bit_recv;
@@ -315,6 +538,7 @@ uint8_t ows_search() {
             ows_send_bit(bit_send);
             ows_send_bit(!bit_send);
             bit_recv = ows_recv_bit();
+            OWS_CHECK(0);
             if (bit_recv != bit_send)
                 return 0;
         }
@@ -323,32 +547,45 @@ uint8_t ows_search() {
     return 1;
 }
 
-void ows_recv_data(char buf[], uint8_t len) {
-    for (int i=0; i<len; i++)
-        buf[i] = ows_recv();
+static uint8_t ows_match()
+{
+    char addr[8];
+    ows_recv_data(addr, 8);
+    OWS_CHECK(0);
+    for (int i=0; i<8; i++)
+        if (ows_rom[i] != addr[i])
+            return 0;
+    return 1;
 }
 
+static inline void ows_send_rom()
+{
+    ows_send_data(ows_rom, 8);
+}
+#endif /* OWS_MULTI_ENABLE */
+
 uint8_t ows_recv_process_cmd() {
-    char addr[8];
+#ifdef OWS_OVERDRIVE_ENABLE
+    uint8_t od;
+#endif
     for (;;) {
-      switch (ows_recv() ) {
+      uint8_t cmd = ows_recv();
+      OWS_CHECK(0);
+      switch (cmd) {
         case 0xF0: // SEARCH ROM
             return ows_search();
         case 0x33: // READ ROM
         case 0x0F:
-            ows_send_data(ows_rom, 8);
+            ows_send_rom();
             break;
 #ifdef OWS_WRITE_ROM_ENABLE
+# ifndef OWS_MULTI_ENABLE
         case 0xD5: // WRITE ROM
-            ows_recv_data(addr, 8);
-            if(addr[0] == ows_rom[0] && addr[7] == ows_crc8(addr, 7))
-            {
-                eeprom_busy_wait();
-                eeprom_write_block(&addr[1], (void*)ows_eeprom_addr, 6);
-                for(uint8_t i = 0; i < 8; ++i)
-                    ows_rom[i] = addr[i];
-            }
-            ows_send_data(ows_rom, 8);
+            ows_write_rom();
+            return 0;
+# endif /* OWS_MULTI_ENABLE */
+        case 0xD6: // EEPROM STATUS
+            ows_eeprom_status();
             return 0;
 #endif /* OWS_WRITE_ROM_ENABLE */
 #ifdef OWS_CONDSEARCH_ENABLE
@@ -356,16 +593,37 @@ uint8_t ows_recv_process_cmd() {
             if(ows_flag & OWS_FLAG_CONDSEARCH)
                 return ows_search();
 #endif
+#ifdef OWS_OVERDRIVE_ENABLE
+        case 0x3C: // OVERDRIVE SKIP ROM
+            ows_flags.od = 1;
+# ifdef OWS_MULTI_ENABLE
+            ows_selected = ows_multi_all;
+# endif
+            return 1;
+        case 0x69: // OVERDRIVE MATCH ROM
+            /* address comes at overdrive speed, but only the selected device stays there */
+            od = ows_flags.od;
+            ows_flags.od = 1;
+            if (!ows_match()) {
+                ows_flags.od = od;
+                return 0;
+            }
+# ifdef OWS_CONDSEARCH_ENABLE
+            ows_flag = 0;
+# endif
+            return 1;
+#endif /* OWS_OVERDRIVE_ENABLE */
         case 0x55: // MATCH ROM
-            ows_recv_data(addr, 8);
-            for (int i=0; i<8; i++)
-                if (ows_rom[i] != addr[i])
-                    return 0;
+            if (!ows_match())
+                return 0;
 #ifdef OWS_CONDSEARCH_ENABLE
             ows_flag = 0;
 #endif
             return 1;
         case 0xCC: // SKIP ROM
+#ifdef OWS_MULTI_ENABLE
+            ows_selected = ows_multi_all;
+#endif
             return 1;
         case 0xA5: // RESUME
             return ows_flags.rc;
@@ -375,23 +633,36 @@ uint8_t ows_recv_process_cmd() {
     }
 }
 
-void __attribute__((weak)) ows_process_cmds() { }
-void __attribute__((weak)) ows_process_interrupt() { }
+static inline void ows_serve_request()
+{
+    if(ows_flags.wait_reset) {
+        ows_wait_reset();
+        OWS_CHECK();
+#ifdef OWS_OVERDRIVE_ENABLE
+        if(!ows_flags.od)
+#endif
+            ows_process_presence();
+    }
+    ows_flags.wait_reset = 0;
+    ows_flags.rc = ows_recv_process_cmd();
+    OWS_CHECK();
+    if(ows_flags.rc)
+        ows_process_cmds();
+    else
+        ows_flags.wait_reset = 1;
+}
 
 void ows_wait_request()
 {
-    switch((errno = setjmp(err)))
+#ifdef OWS_ERRNO_ENABLE
+    errno = ONEWIRE_NO_ERROR;
+    ows_serve_request();
+#else
+    if(!(errno = setjmp(err)))
+        ows_serve_request();
+#endif
+    switch(errno)
     {
-        case 0:
-            if(ows_flags.wait_reset)
-                ows_wait_reset();
-            ows_flags.wait_reset = 0;
-            ows_flags.rc = ows_recv_process_cmd();
-            if(ows_flags.rc)
-                ows_process_cmds();
-            else
-                ows_flags.wait_reset = 1;
-            break;
         case ONEWIRE_TIMESLOT_TIMEOUT:
         case ONEWIRE_VERY_SHORT_RESET:
         case ONEWIRE_PRESENCE_LOW_ON_LINE:
@@ -407,7 +678,383 @@ void ows_wait_request()
     }
 }
 
+#else /* OWS_ASYNC_ENABLE */
+
+/* engine timing, timer 0 counts from the falling edge of a time slot */
+#define OWS_ASYNC_SAMPLE  uS_TO_TIMER_COUNTS(24)  /* read master's bit */
+#define OWS_ASYNC_HOLD    uS_TO_TIMER_COUNTS(32)  /* release our '0' */
+#define OWS_ASYNC_RESET   uS_TO_TIMER_COUNTS(400) /* shortest accepted reset */
+#define OWS_ASYNC_PDWAIT  uS_TO_TIMER_COUNTS(30)  /* reset end .. presence */
+#define OWS_ASYNC_PDLEN   uS_TO_TIMER_COUNTS(30 + 120)
+
+#define OWS_ASYNC_QUEUE_SIZE 4 /* power of 2 */
+
+enum ows_async_state {
+    OWS_AS_IDLE,          /* not addressed, waiting for reset */
+    OWS_AS_PRESENCE_WAIT,
+    OWS_AS_PRESENCE,
+    OWS_AS_ROM_CMD,
+    OWS_AS_READ_ROM,
+    OWS_AS_MATCH_ROM,
+    OWS_AS_SEARCH,
+    OWS_AS_FUNCTION,      /* selected, bytes go through the queues */
+};
+
+enum ows_async_flags {
+    OWS_AF_LOW      = 0x01, /* master holds the bus low */
+    OWS_AF_PULL     = 0x02, /* send '0' in the next time slot */
+    OWS_AF_TX       = 0x04, /* current byte is being sent */
+    OWS_AF_DRIVING  = 0x08, /* presence pulse, ignore own edges */
+    OWS_AF_SELECTED = 0x10, /* ows_process_cmds() has to be called */
+    OWS_AF_RC       = 0x20, /* resume flag */
+    OWS_AF_SAMPLED  = 0x40, /* bit of the current time slot is done */
+};
+
+static volatile struct {
+    uint8_t state;
+    uint8_t flags;
+    uint8_t bitmask;  /* current bit of shift */
+    uint8_t shift;    /* byte being sent or received */
+    uint8_t count;    /* byte (bit for search) number */
+    uint8_t rx_head, rx_tail;
+    uint8_t tx_head, tx_tail;
+    uint8_t rx[OWS_ASYNC_QUEUE_SIZE];
+    uint8_t tx[OWS_ASYNC_QUEUE_SIZE];
+#ifdef OWS_WRITE_ROM_ENABLE
+    uint8_t rom_cmd;  /* D5/D6 for ows_wait_request(), not a function command */
+#endif
+} ows_async;
+
+volatile uint16_t ows_idle_count;
+
+static void ows_async_start()
+{
+    ows_async.state = OWS_AS_IDLE;
+    ows_async.flags = 0;
+    ows_hal_timer_start();
+    ows_hal_pcint_enable();
+    sei();
+}
+
+/* set up shift register for the next byte of the current state */
+static void ows_async_next_byte()
+{
+    uint8_t f = ows_async.flags & ~(OWS_AF_TX | OWS_AF_PULL);
+    ows_async.bitmask = 0x01;
+    ows_async.shift = 0;
+    switch (ows_async.state) {
+        case OWS_AS_READ_ROM:
+            ows_async.shift = ows_rom[ows_async.count];
+            f |= OWS_AF_TX;
+            break;
+        case OWS_AS_FUNCTION:
+            if (ows_async.tx_head != ows_async.tx_tail) {
+                ows_async.shift = ows_async.tx[ows_async.tx_tail];
+                ows_async.tx_tail = (ows_async.tx_tail + 1) & (OWS_ASYNC_QUEUE_SIZE - 1);
+                f |= OWS_AF_TX;
+            }
+            break;
+    }
+    if ((f & OWS_AF_TX) && !(ows_async.shift & 0x01))
+        f |= OWS_AF_PULL;
+    ows_async.flags = f;
+}
+
+static void ows_async_select()
+{
+#ifdef OWS_CONDSEARCH_ENABLE
+    ows_flag = 0;
+#endif
+    ows_async.state = OWS_AS_FUNCTION;
+    ows_async.flags |= OWS_AF_SELECTED | OWS_AF_RC;
+}
+
+static void ows_async_rom_cmd(uint8_t cmd)
+{
+    ows_async.count = 0;
+#ifdef OWS_WRITE_ROM_ENABLE
+    ows_async.rom_cmd = 0;
+#endif
+    switch (cmd) {
 #ifdef OWS_CONDSEARCH_ENABLE
+        case 0xEC: // CONDITIONAL SEARCH
+            if (!(ows_flag & OWS_FLAG_CONDSEARCH))
+                break;
+            /* no break */
+#endif
+        case 0xF0: // SEARCH ROM
+            ows_async.flags &= ~OWS_AF_RC;
+            ows_async.state = OWS_AS_SEARCH;
+            ows_async.shift = 0; /* triplet phase */
+            ows_async.flags |= (ows_rom[0] & 0x01) ? 0 : OWS_AF_PULL;
+            return;
+        case 0x33: // READ ROM
+        case 0x0F:
+            ows_async.state = OWS_AS_READ_ROM;
+            return;
+        case 0x55: // MATCH ROM
+            ows_async.state = OWS_AS_MATCH_ROM;
+            return;
+        case 0xCC: // SKIP ROM
+            ows_async_select();
+            return;
+        case 0xA5: // RESUME
+            if (ows_async.flags & OWS_AF_RC) {
+                ows_async_select();
+                return;
+            }
+            break;
+#ifdef OWS_WRITE_ROM_ENABLE
+        /* their bytes go through the queues, the main loop serves them */
+# ifndef OWS_MULTI_ENABLE
+        case 0xD5: // WRITE ROM
+# endif
+        case 0xD6: // EEPROM STATUS
+            ows_async.rom_cmd = cmd;
+            ows_async.state = OWS_AS_FUNCTION;
+            ows_async.flags |= OWS_AF_SELECTED;
+            return;
+#endif
+    }
+    ows_async.state = OWS_AS_IDLE;
+}
+
+static void ows_async_search_bit(uint8_t b)
+{
+    uint8_t n = ows_async.count;
+    uint8_t r = (ows_rom[n >> 3] >> (n & 7)) & 0x01;
+    switch (ows_async.shift++) {
+        case 0: /* sent our bit, complement goes next */
+            if (r)
+                ows_async.flags |= OWS_AF_PULL;
+            return;
+        case 1: /* sent complement, master's choice goes next */
+            return;
+    }
+    ows_async.shift = 0;
+    if (b != r) {
+        ows_async.state = OWS_AS_IDLE;
+        return;
+    }
+    if (++n == 64) {
+        ows_async.flags |= OWS_AF_RC;
+        ows_async.state = OWS_AS_IDLE;
+        return;
+    }
+    ows_async.count = n;
+    if (!((ows_rom[n >> 3] >> (n & 7)) & 0x01))
+        ows_async.flags |= OWS_AF_PULL;
+}
+
+/* time slot finished, b is the sampled bus state */
+static void ows_async_bit(uint8_t b)
+{
+    uint8_t f = ows_async.flags & ~OWS_AF_PULL;
+    ows_async.flags = f;
+    if (ows_async.state == OWS_AS_SEARCH) {
+        ows_async_search_bit(b);
+        return;
+    }
+    if (b && !(f & OWS_AF_TX))
+        ows_async.shift |= ows_async.bitmask;
+    ows_async.bitmask <<= 1;
+    if (ows_async.bitmask) {
+        if ((f & OWS_AF_TX) && !(ows_async.shift & ows_async.bitmask))
+            ows_async.flags = f | OWS_AF_PULL;
+        return;
+    }
+    /* byte complete */
+    b = ows_async.shift;
+    switch (ows_async.state) {
+        case OWS_AS_ROM_CMD:
+            ows_async_rom_cmd(b);
+            break;
+        case OWS_AS_READ_ROM:
+            if (++ows_async.count == 8)
+                ows_async.state = OWS_AS_ROM_CMD;
+            break;
+        case OWS_AS_MATCH_ROM:
+            if (ows_rom[ows_async.count] != (char)b)
+                ows_async.state = OWS_AS_IDLE;
+            else if (++ows_async.count == 8)
+                ows_async_select();
+            break;
+        case OWS_AS_FUNCTION:
+            if (!(f & OWS_AF_TX)) {
+                uint8_t h = (ows_async.rx_head + 1) & (OWS_ASYNC_QUEUE_SIZE - 1);
+                if (h != ows_async.rx_tail) {
+                    ows_async.rx[ows_async.rx_head] = b;
+                    ows_async.rx_head = h;
+                }
+            }
+            break;
+    }
+    if (ows_async.state != OWS_AS_SEARCH)
+        ows_async_next_byte();
+}
+
+ISR(OWPCINT_vect)
+{
+    uint8_t f = ows_async.flags;
+    if (f & OWS_AF_DRIVING)
+        return;
+    if (!ows_read_bus()) { /* falling edge: time slot or reset begins */
+        if (f & OWS_AF_PULL)
+            ows_pull_bus_down();
+        ows_hal_timer_clear();
+        ows_hal_timer_clear_flags();
+        ows_async.flags = (f & ~OWS_AF_SAMPLED) | OWS_AF_LOW;
+        if (ows_async.state != OWS_AS_IDLE) {
+            ows_hal_timer_compare((f & OWS_AF_PULL) ? OWS_ASYNC_HOLD : OWS_ASYNC_SAMPLE);
+            ows_hal_timer_irq_enable();
+        }
+    } else if (f & OWS_AF_LOW) { /* rising edge */
+        ows_async.flags = f & ~OWS_AF_LOW;
+        if (ows_hal_timer_overflow() || ows_hal_timer_read() >= OWS_ASYNC_RESET) {
+            if (ows_async.state == OWS_AS_FUNCTION)
+                errno = ONEWIRE_TOO_LONG_PULSE;
+            ows_async.rx_head = ows_async.rx_tail = 0;
+            ows_async.tx_head = ows_async.tx_tail = 0;
+            ows_async.state = OWS_AS_PRESENCE_WAIT;
+            ows_hal_timer_clear();
+            ows_hal_timer_compare(OWS_ASYNC_PDWAIT);
+            ows_hal_timer_clear_flags();
+            ows_hal_timer_irq_enable();
+        }
+    }
+}
+
+ISR(OWTIMER_COMPA_vect)
+{
+    switch (ows_async.state) {
+        case OWS_AS_PRESENCE_WAIT:
+            ows_async.flags |= OWS_AF_DRIVING;
+            ows_pull_bus_down();
+            ows_async.state = OWS_AS_PRESENCE;
+            ows_hal_timer_compare(OWS_ASYNC_PDLEN);
+            return;
+        case OWS_AS_PRESENCE:
+            ows_release_bus();
+            ows_hal_timer_irq_disable();
+            ows_async.state = OWS_AS_ROM_CMD;
+            ows_async_next_byte();
+            ows_async.flags &= ~(OWS_AF_DRIVING | OWS_AF_LOW);
+            return;
+    }
+    ows_hal_timer_irq_disable();
+    if (ows_async.flags & OWS_AF_PULL)
+        ows_release_bus();
+    ows_async.flags |= OWS_AF_SAMPLED;
+    ows_async_bit(ows_read_bus());
+}
+
+uint8_t ows_recv_available()
+{
+    return (ows_async.rx_head - ows_async.rx_tail) & (OWS_ASYNC_QUEUE_SIZE - 1);
+}
+
+/* sleep until an interrupt occurs, returns immediately if cond is already false */
+#define OWS_ASYNC_SLEEP_WHILE(cond) \
+    do { cli(); if (cond) { sei(); ows_hal_sleep(); } sei(); } while (0)
+
+uint8_t ows_recv()
+{
+    uint8_t r;
+    for (;;) {
+        if (errno)
+            return 0xFF;
+        if (ows_async.rx_head != ows_async.rx_tail)
+            break;
+        OWS_ASYNC_SLEEP_WHILE(ows_async.rx_head == ows_async.rx_tail && !errno);
+    }
+    r = ows_async.rx[ows_async.rx_tail];
+    ows_async.rx_tail = (ows_async.rx_tail + 1) & (OWS_ASYNC_QUEUE_SIZE - 1);
+    return r;
+}
+
+void ows_send(uint8_t v)
+{
+    uint8_t h;
+    for (;;) {
+        if (errno)
+            return;
+        h = (ows_async.tx_head + 1) & (OWS_ASYNC_QUEUE_SIZE - 1);
+        if (h != ows_async.tx_tail)
+            break;
+        OWS_ASYNC_SLEEP_WHILE(h == ows_async.tx_tail && !errno);
+    }
+    ows_async.tx[ows_async.tx_head] = v;
+    cli();
+    ows_async.tx_head = h;
+    /*
+     * queue was empty and no time slot of the next byte has started yet,
+     * the master may still hold the bus low in the last slot of the previous
+     */
+    if (ows_async.state == OWS_AS_FUNCTION && ows_async.bitmask == 0x01
+            && !(ows_async.flags & OWS_AF_TX)
+            && (ows_async.flags & (OWS_AF_LOW | OWS_AF_SAMPLED)) != OWS_AF_LOW)
+        ows_async_next_byte();
+    sei();
+}
+
+void ows_wait_request()
+{
+#ifdef OWS_WRITE_ROM_ENABLE
+    uint8_t rom_cmd;
+#endif
+    OWS_ASYNC_SLEEP_WHILE(!(ows_async.flags & OWS_AF_SELECTED));
+    cli();
+    if (ows_async.flags & OWS_AF_SELECTED) {
+        ows_async.flags &= ~OWS_AF_SELECTED;
+        errno = ONEWIRE_NO_ERROR;
+#ifdef OWS_WRITE_ROM_ENABLE
+        rom_cmd = ows_async.rom_cmd;
+#endif
+        sei();
+#ifdef OWS_WRITE_ROM_ENABLE
+        if (rom_cmd == 0xD6)
+            ows_eeprom_status();
+# ifndef OWS_MULTI_ENABLE
+        else if (rom_cmd == 0xD5)
+            ows_write_rom();
+# endif
+        else
+#endif
+        ows_process_cmds();
+        /* what is queued still goes out, the last '0' needs its release */
+        while ((ows_async.tx_head != ows_async.tx_tail || (ows_async.flags & OWS_AF_TX)) && !errno)
+            OWS_ASYNC_SLEEP_WHILE((ows_async.tx_head != ows_async.tx_tail
+                    || (ows_async.flags & OWS_AF_TX)) && !errno);
+        cli();
+        if (ows_async.state == OWS_AS_FUNCTION && !errno)
+            ows_async.state = OWS_AS_IDLE; /* ignore the rest until reset */
+        sei();
+    } else {
+        sei();
+        ++ows_idle_count;
+        ows_process_interrupt();
+    }
+}
+
+#endif /* OWS_ASYNC_ENABLE */
+
+void ows_recv_data(char buf[], uint8_t len) {
+    for (int i=0; i<len; i++)
+        buf[i] = ows_recv();
+}
+
+void ows_send_data(const char buf[], uint8_t len)
+{
+    for (uint8_t i = 0; i < len; ++i)
+        ows_send(buf[i]);
+}
+
+void __attribute__((weak)) ows_process_cmds() { }
+void __attribute__((weak)) ows_process_interrupt() { }
+void __attribute__((weak)) ows_process_presence() { }
+
+#ifdef OWS_CONDSEARCH_ENABLE
+# ifdef OWS_INTERRUPTS_ENABLE
 static void ows_generate_spontaneous_interrupt()
 {
     ows_pull_bus_down();
@@ -417,10 +1064,17 @@ static void ows_generate_spontaneous_interrupt()
     ows_delay_30uS();
     ows_presence();
 }
+# endif /* OWS_INTERRUPTS_ENABLE */
 
 void ows_set_flag(enum ows_flag_type f)
 {
+# ifdef OWS_ASYNC_ENABLE
+    cli(); /* MATCH ROM clears ows_flag from the interrupt */
     ows_flag = (ows_flag & ~OWS_FLAG_MASK) | (f & OWS_FLAG_MASK);
+    sei();
+# else
+    ows_flag = (ows_flag & ~OWS_FLAG_MASK) | (f & OWS_FLAG_MASK);
+# endif
 # ifdef OWS_INTERRUPTS_ENABLE
     if(f & OWS_FLAG_INT_TYPE1 && (ows_flag && OWS_FLAG_INTERRUPT_POSSIBLE))
         ows_generate_spontaneous_interrupt();
@@ -7,7 +7,7 @@
 
 /* check predefines with << avr-cpp -dM -mmcu=atmega168 ows.c | grep -i avr >> */
 #if defined(__AVR_ATmega168__)
-# pragma message ===== Configured for ATMega168 =====
+# pragma message "===== Configured for ATMega168 ====="
 /* Arduino Nano:
  Arduino pin:   D0 .. D7    D8 .. D13   A0 .. A5    A6    A7
  ATMega port:  PD0 .. PD7  PB0 .. PB5  PC0 .. PC5  ADC6  ADC7
@@ -16,33 +16,62 @@
 # define OWMASK 0x80
 # define OWPORT(x) x##D
 # define OWPCMSK PCMSK2 /* PCMSK0 - Port B, PCMSK1 - Port C, PCMSK2 - Port D */
+# define OWPCINT_vect PCINT2_vect
+# define OWTIMER_COMPA_vect TIMER0_COMPA_vect
+# define OWEE_READY_vect EE_READY_vect
 # define PIO_PORT(p) (p##B) /* hardcoded pins 0(A) and 2(B) ==> pins 8 and 10 on Arduino nano */
 #elif defined(__AVR_ATtiny13__)
-# pragma message ===== Configured for ATTiny(13) =====
+# pragma message "===== Configured for ATTiny(13) ====="
 # define CLK_FREQ 9600L
 # define OWMASK 0x02
 # define OWPORT(x) x##B
 # define OWPCMSK PCMSK
+# define OWPCINT_vect PCINT0_vect
+# define OWTIMER_COMPA_vect TIM0_COMPA_vect
+# define OWEE_READY_vect EE_RDY_vect
 # define PIO_PORT(p) (p##B) /* hardcoded pins 0(A) and 2(B) */
 #elif defined(__AVR_ATtiny85__) || defined(__AVR_ATtiny45__) || defined(__AVR_ATtiny25__)
-# pragma message ===== Configured for ATTiny(25,45,85) =====
+# pragma message "===== Configured for ATTiny(25,45,85) ====="
 # define CLK_FREQ 8000L
 # define OWMASK 0x10
 # define OWPORT(x) x##B
 # define OWPCMSK PCMSK
+# define OWPCINT_vect PCINT0_vect
+# define OWTIMER_COMPA_vect TIM0_COMPA_vect
+# define OWEE_READY_vect EE_RDY_vect
 # define PIO_PORT(p) (p##B) /* hardcoded pins b0(A), b1(B), b2(C), b3(D) */
+#elif defined(OWS_HOST)
+# pragma message "===== Configured for host simulation ====="
+/* native build against host/ows_host.c, pinout of ATTiny45 */
+# ifndef CLK_FREQ
+#  define CLK_FREQ 8000L /* ds2480_host runs at 16000 */
+# endif
+# define OWMASK 0x10
+# define OWPORT(x) x##B
+# define OWPCMSK PCMSK
+# define OWPCINT_vect PCINT0_vect
+# define OWTIMER_COMPA_vect TIM0_COMPA_vect
+# define OWEE_READY_vect EE_RDY_vect
+# define PIO_PORT(p) (p##B)
 #else
 # error Unsupported MCU
 #endif
 
+#if defined(OWS_ASYNC_ENABLE) && defined(OWS_INTERRUPTS_ENABLE)
+# error Spontaneous interrupts are not supported by the interrupt-driven engine
+#endif
+#if defined(OWS_MULTI_ENABLE) && (defined(OWS_ASYNC_ENABLE) || defined(OWS_CONDSEARCH_ENABLE))
+# error Multiple ROMs are only supported by the busy waiting engine, without conditional search
+#endif
+
 #ifdef OWS_CONDSEARCH_ENABLE
 enum ows_flag_type {
     OWS_FLAG_CONDSEARCH = 0x01,
 # ifdef OWS_INTERRUPTS_ENABLE
     OWS_FLAG_INT_TYPE1  = 0x02,
     OWS_FLAG_INT_TYPE2  = 0x04,
-    OWS_FLAG_MASK       = 0x0F,
 # endif
+    OWS_FLAG_MASK       = 0x0F,
 };
 void ows_set_flag(enum ows_flag_type f);
 #endif
@@ -66,10 +95,48 @@ void ows_recv_data(char buf[], uint8_t len);
 void ows_send(uint8_t v);
 void ows_send_data(const char buf[], uint8_t len);
 
+#ifdef OWS_MULTI_ENABLE
+/*
+ * One MCU answering as up to 8 devices: roms[i][0..6] are their IDs (the
+ * CRC goes to roms[i][7]). SEARCH ROM and MATCH ROM narrow the candidates
+ * down bit by bit; ows_process_cmds() finds the instances the request is
+ * for in ows_selected, bit i for roms[i], all of them after SKIP ROM.
+ * WRITE ROM is not available.
+ */
+void ows_setup_multi(char roms[][8], uint8_t n);
+extern uint8_t ows_selected;
+#endif
+
 /* override to add functionality */
 void ows_process_cmds();
 void ows_process_interrupt();
+/*
+ * Busy waiting engine only, right after the presence pulse of a standard
+ * speed reset: the ROM command can't start before 480uS after the reset,
+ * some 330uS after our presence pulse. The place for bookkeeping the end
+ * of a request can't do, the next reset is being timed there. Keep it well
+ * under 150uS. Not called at overdrive, the ROM command follows within
+ * 20uS there.
+ */
+void ows_process_presence();
 
+#ifdef OWS_ASYNC_ENABLE
+/*
+ * Interrupt-driven engine: pin change and timer 0 compare interrupts run
+ * the whole ROM layer, function command bytes go through small queues.
+ * ows_wait_request() sleeps until something happens and calls
+ * ows_process_cmds() when the device is selected or ows_process_interrupt()
+ * on any other wake-up, so the main loop keeps running during bus traffic.
+ */
+uint8_t ows_recv_available();
+extern volatile uint16_t ows_idle_count; /* main loop passes, for profiling */
+#endif
+
+/*
+ * Set when the bus broke the current request (reset, stuck line...); with
+ * OWS_ERRNO_ENABLE or OWS_ASYNC_ENABLE the transfer functions keep returning
+ * at once until ows_wait_request() sees it, so loops have to check it.
+ */
 extern uint8_t errno;
 
 #endif /* OWS_H_INCLUDED */
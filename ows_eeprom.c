@@ -0,0 +1,174 @@
+#include "ows_eeprom.h"
+#include "ows_hal.h"
+#include "ow_crc8.h"
+
+#ifdef OWS_EEPROM_QUEUE_ENABLE
+
+#define OWS_EEPROM_QUEUE_MASK (OWS_EEPROM_QUEUE_LEN - 1)
+
+/*
+ * Written at tail by the request handlers, programmed from head by the
+ * ISR. The entry being programmed stays at head until it is done, so
+ * the queue always holds everything that isn't in the EEPROM yet; the
+ * entries before head are what the EEPROM holds now, reads use them too.
+ */
+static struct {
+    uint16_t addr;
+    uint8_t data;
+} ows_eeprom_queue[OWS_EEPROM_QUEUE_LEN];
+static volatile uint8_t ows_eeprom_head, ows_eeprom_tail;
+static uint8_t ows_eeprom_started; /* head is being programmed */
+static uint8_t ows_eeprom_filled; /* entries ever written, up to the mask */
+
+void ows_eeprom_poll()
+{
+    uint8_t h = ows_eeprom_head;
+    if ((h == ows_eeprom_tail && !ows_eeprom_started) || ows_hal_eeprom_busy())
+        return;
+    if (ows_eeprom_started) {
+        ows_eeprom_started = 0;
+        ows_eeprom_head = h = (h + 1) & OWS_EEPROM_QUEUE_MASK;
+    }
+    if (h == ows_eeprom_tail) {
+        ows_hal_eeprom_irq_disable();
+        return;
+    }
+    ows_hal_eeprom_write(ows_eeprom_queue[h].addr, ows_eeprom_queue[h].data);
+    ows_eeprom_started = 1;
+}
+
+/* EEPROM ready is a level interrupt: fires until the queue is empty */
+ISR(OWEE_READY_vect)
+{
+    ows_eeprom_poll();
+}
+
+void ows_eeprom_write(uint16_t addr, const void *src, uint8_t len)
+{
+    const uint8_t *p = src;
+    while (len--) {
+        uint8_t t = ows_eeprom_tail, sreg;
+        uint8_t next = (t + 1) & OWS_EEPROM_QUEUE_MASK;
+        while (next == ows_eeprom_head) {
+#ifndef OWS_ASYNC_ENABLE
+            ows_eeprom_poll(); /* interrupts are off while serving a request */
+#endif
+        }
+        sreg = SREG;
+        cli(); /* the ISR reads tail and clears EERIE, e.g. with OWS_ASYNC_ENABLE */
+        ows_eeprom_queue[t].addr = addr++;
+        ows_eeprom_queue[t].data = *p++;
+        ows_eeprom_tail = next;
+        if (ows_eeprom_filled < OWS_EEPROM_QUEUE_MASK)
+            ++ows_eeprom_filled;
+        ows_hal_eeprom_irq_enable();
+        SREG = sreg;
+    }
+}
+
+/* reading the EEPROM waits for the byte in progress, so only what the queue doesn't have */
+void ows_eeprom_read(void *dst, uint16_t addr, uint8_t len)
+{
+    uint8_t *p = dst;
+    for (uint8_t n = 0; n < len; ++n, ++addr) {
+        uint8_t i = ows_eeprom_tail;
+        for (uint8_t k = ows_eeprom_filled;; --k) {
+            if (!k) {
+                p[n] = eeprom_read_byte((const uint8_t*)addr);
+                break;
+            }
+            i = (i - 1) & OWS_EEPROM_QUEUE_MASK; /* newest first */
+            if (ows_eeprom_queue[i].addr == addr) {
+                p[n] = ows_eeprom_queue[i].data;
+                break;
+            }
+        }
+    }
+}
+
+uint8_t ows_eeprom_pending()
+{
+    return (ows_eeprom_tail - ows_eeprom_head) & OWS_EEPROM_QUEUE_MASK;
+}
+
+#endif /* OWS_EEPROM_QUEUE_ENABLE */
+
+#ifdef OWS_WEAR_LEVEL_ENABLE
+
+#define OWS_RECORD_NEXT(s) ((s) == 0xFE ? 0 : (s) + 1)
+
+static uint16_t ows_record_addr(struct ows_record *r, uint8_t slot)
+{
+    return r->base + (uint16_t)slot * (r->size + 2);
+}
+
+static uint8_t ows_record_byte(uint16_t addr)
+{
+    uint8_t b;
+    ows_eeprom_read(&b, addr, 1); /* sees queued saves too */
+    return b;
+}
+
+/* newest slot: the last one before the sequence breaks */
+static void ows_record_find(struct ows_record *r)
+{
+    uint8_t i, last = ows_record_byte(r->base);
+    for (i = 1; i < r->slots; ++i) {
+        uint8_t s = ows_record_byte(ows_record_addr(r, i));
+        if (s != OWS_RECORD_NEXT(last))
+            break;
+        last = s;
+    }
+    r->cur = i - 1;
+    r->seq = last;
+}
+
+uint8_t ows_record_load(struct ows_record *r, void *dst)
+{
+    uint8_t slot;
+    if (r->cur == 0xFF)
+        ows_record_find(r);
+    slot = r->cur;
+    for (uint8_t n = r->slots; n; --n) {
+        uint16_t addr = ows_record_addr(r, slot);
+        uint8_t seq = ows_record_byte(addr);
+        if (seq != 0xFF) {
+            uint8_t crc = ow_crc8_update(0, seq);
+            ows_eeprom_read(dst, addr + 1, r->size);
+            for (uint8_t i = 0; i < r->size; ++i)
+                crc = ow_crc8_update(crc, ((uint8_t*)dst)[i]);
+            if (crc == ows_record_byte(addr + 1 + r->size)) {
+                r->cur = slot;
+                r->seq = seq;
+                return 1;
+            }
+        }
+        slot = (slot ? slot : r->slots) - 1; /* an older one */
+    }
+    r->cur = r->slots - 1; /* none, the next save goes to slot 0 */
+    r->seq = 0xFE;
+    return 0;
+}
+
+void ows_record_save(struct ows_record *r, const void *src)
+{
+    uint8_t crc;
+    uint16_t addr;
+    if (r->cur == 0xFF)
+        ows_record_find(r);
+    r->cur = (r->cur + 1 == r->slots) ? 0 : r->cur + 1;
+    r->seq = OWS_RECORD_NEXT(r->seq);
+    addr = ows_record_addr(r, r->cur);
+    crc = ow_crc8_update(0, r->seq);
+    for (uint8_t i = 0; i < r->size; ++i)
+        crc = ow_crc8_update(crc, ((const uint8_t*)src)[i]);
+    ows_eeprom_write(addr, &r->seq, 1);
+    ows_eeprom_write(addr + 1, src, r->size);
+    ows_eeprom_write(addr + 1 + r->size, &crc, 1);
+}
+
+#endif /* OWS_WEAR_LEVEL_ENABLE */
+
+/*
+ vim: ts=4 sw=4 sts=4 et
+*/
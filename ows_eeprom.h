@@ -0,0 +1,96 @@
+#ifndef OWS_EEPROM_H_INCLUDED
+#define OWS_EEPROM_H_INCLUDED
+
+/*
+ * EEPROM writes that don't hold up the bus. A byte takes 3.4mS to program,
+ * so a plain eeprom_write_block() of a ROM ID or a config block keeps the
+ * slave deaf for tens of mS. With OWS_EEPROM_QUEUE_ENABLE the bytes go to a
+ * small queue instead and the EE_READY interrupt programs them one after
+ * the other while the slave sleeps between requests; ows_eeprom_read()
+ * sees the queued data at once. Without it the same calls simply write
+ * synchronously, e.g. on attiny13 where the RAM isn't there.
+ *
+ * The master learns when everything is committed with the EEPROM STATUS
+ * ROM command (0xD6): read slots give 00 while a write is pending, FF after.
+ */
+
+#include <stdint.h>
+#include <avr/eeprom.h>
+
+#ifdef OWS_EEPROM_QUEUE_ENABLE
+
+#ifndef OWS_EEPROM_QUEUE_LEN
+# define OWS_EEPROM_QUEUE_LEN 16 /* power of 2, a ROM ID and a config block */
+#endif
+
+/* queue len bytes for addr, waits only if the queue is full */
+void ows_eeprom_write(uint16_t addr, const void *src, uint8_t len);
+/* EEPROM contents as they will be once the queue is drained */
+void ows_eeprom_read(void *dst, uint16_t addr, uint8_t len);
+/* bytes not programmed yet, including the one in progress */
+uint8_t ows_eeprom_pending();
+/* start the next byte if the EEPROM is idle; interrupts must be disabled */
+void ows_eeprom_poll();
+
+#else /* OWS_EEPROM_QUEUE_ENABLE */
+
+static inline void ows_eeprom_write(uint16_t addr, const void *src, uint8_t len)
+{
+    eeprom_busy_wait();
+    eeprom_write_block(src, (void*)addr, len);
+}
+
+static inline void ows_eeprom_read(void *dst, uint16_t addr, uint8_t len)
+{
+    eeprom_read_block(dst, (const void*)addr, len);
+}
+
+static inline uint8_t ows_eeprom_pending()
+{
+    return !eeprom_is_ready();
+}
+
+static inline void ows_eeprom_poll()
+{
+}
+
+#endif /* OWS_EEPROM_QUEUE_ENABLE */
+
+#ifdef OWS_WEAR_LEVEL_ENABLE
+/*
+ * Wear leveled records: a store is a ring of slots, each [seq][data][crc8].
+ * Every save goes to the slot after the newest one with the next sequence
+ * number (0..FE, FF is blank EEPROM), so the cells are rewritten once per
+ * lap of the ring instead of on every save. The newest record is where the
+ * sequence breaks; if its CRC is bad (power lost while writing) the one
+ * before it is used. Finding it reads one byte per slot.
+ *
+ * EEPROM layout: the first 16 bytes are the fixed cells older firmware
+ * used (ROM ID at the ows_setup2() address, ds2413ex config at 6), only
+ * read while a store is still empty. The ROM ID store follows up to the
+ * middle of the EEPROM, the device's own store takes the upper half.
+ */
+struct ows_record {
+    uint16_t base;
+    uint8_t size;   /* of the data */
+    uint8_t slots;
+    uint8_t cur;    /* newest slot, 0xFF until looked up */
+    uint8_t seq;
+};
+
+#define OWS_RECORD_SLOTS(base, end, size) (((end) + 1 - (base)) / ((size) + 2))
+#define OWS_RECORD(base, end, size) { (base), (size), OWS_RECORD_SLOTS(base, end, size), 0xFF, 0xFF }
+#define OWS_ROM_STORE_BASE 0x10
+#define OWS_APP_STORE_BASE ((E2END + 1) / 2)
+
+/* newest valid record to dst, 0 if there is none (dst is garbage then) */
+uint8_t ows_record_load(struct ows_record *r, void *dst);
+/* queued like any other ows_eeprom_write() */
+void ows_record_save(struct ows_record *r, const void *src);
+#endif /* OWS_WEAR_LEVEL_ENABLE */
+
+#endif /* OWS_EEPROM_H_INCLUDED */
+
+/*
+ vim: ts=4 sw=4 sts=4 et
+*/
@@ -0,0 +1,192 @@
+#ifndef OWS_HAL_H_INCLUDED
+#define OWS_HAL_H_INCLUDED
+
+/*
+ * Everything the slave core does to the hardware: the bus pin and its pin
+ * change interrupt, timer 0, sleep, EEPROM programming and the busy-wait
+ * loops.
+ * The AVR backend is plain register access, inlined into the same code
+ * ows.c had before. With OWS_HOST the functions live in host/ows_host.c,
+ * which drives a simulated open-drain bus and clock so the core and the
+ * device files run natively on Linux.
+ */
+
+#include "ows.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#ifndef OWS_HOST
+
+#ifdef TIMSK0
+# define OWS_TIMSK TIMSK0
+# define OWS_TIFR TIFR0
+#else
+# define OWS_TIMSK TIMSK
+# define OWS_TIFR TIFR
+#endif
+
+static inline void ows_pull_bus_down()
+{
+    OWPORT(DDR) |= (OWMASK);    // drives output low
+}
+
+static inline void ows_release_bus()
+{
+    OWPORT(DDR) &= ~(OWMASK);
+}
+
+static inline uint8_t ows_read_bus()
+{
+    return (OWPORT(PIN) & OWMASK) ? 1 : 0;
+}
+
+static inline void ows_hal_setup()
+{
+    OWPORT(PORT) &= ~(OWMASK); /* We only need "0" - simulate open drain */
+#ifdef GIFR /* tiny45 */
+    GIMSK |= (1 << PCIE); /* enable pin change interrupts */
+#else
+    PCICR |= 0x07; /* enable all pin change interrupts */
+#endif
+    MCUCR = 1<<SE; /* sleep enable (idle mode) */
+}
+
+static inline void ows_hal_pcint_enable()
+{
+    OWPCMSK |= OWMASK;
+}
+
+static inline void ows_hal_pcint_disable()
+{
+    OWPCMSK &= ~OWMASK;
+}
+
+static inline void ows_hal_sleep()
+{
+    sleep_cpu();
+}
+
+/* timer 0: normal mode, clk/64, all its interrupts off */
+static inline void ows_hal_timer_start()
+{
+    TCCR0A = 0x00; // Normal mode
+    TCCR0B = 0x03; // clk/64
+    OWS_TIMSK &= ~(1<<OCIE0A | 1<<OCIE0B | 1<<TOIE0);
+}
+
+static inline void ows_hal_timer_stop()
+{
+    TCCR0B = 0x00;
+}
+
+static inline uint8_t ows_hal_timer_read()
+{
+    return TCNT0;
+}
+
+static inline void ows_hal_timer_clear()
+{
+    TCNT0 = 0;
+}
+
+static inline uint8_t ows_hal_timer_overflow()
+{
+    return OWS_TIFR & (1<<TOV0);
+}
+
+static inline void ows_hal_timer_clear_flags()
+{
+    OWS_TIFR = 1<<OCF0A | 1<<TOV0;
+}
+
+static inline void ows_hal_timer_compare(uint8_t count)
+{
+    OCR0A = count;
+}
+
+static inline void ows_hal_timer_irq_enable()
+{
+    OWS_TIMSK |= 1<<OCIE0A;
+}
+
+static inline void ows_hal_timer_irq_disable()
+{
+    OWS_TIMSK &= ~(1<<OCIE0A);
+}
+
+/* EEPROM: start programming one byte, ready interrupt for ows_eeprom.c */
+static inline uint8_t ows_hal_eeprom_busy()
+{
+    return EECR & (1<<EEPE);
+}
+
+static inline void ows_hal_eeprom_write(uint16_t addr, uint8_t data)
+{
+    EEAR = addr;
+    EEDR = data;
+    EECR |= 1<<EEMPE; /* erase and write, EEPE within 4 clocks */
+    EECR |= 1<<EEPE;
+}
+
+static inline void ows_hal_eeprom_irq_enable()
+{
+    EECR |= 1<<EERIE;
+}
+
+static inline void ows_hal_eeprom_irq_disable()
+{
+    EECR &= ~(1<<EERIE);
+}
+
+/* busy waits, 4 clocks per loop */
+static inline void ows_hal_delay4(uint16_t loops)
+{
+    __asm__ __volatile__ (
+        "1: sbiw %0,1" "\n\t" // 2 cycles
+        "brne 1b" : "=w" (loops) : "0" (loops) // 2 cycles
+    );
+}
+
+/* 3 clocks per loop, for the few uS of overdrive */
+static inline void ows_hal_delay3(uint8_t loops)
+{
+    __asm__ __volatile__ (
+        "1: dec %0" "\n\t" // 1 cycle
+        "brne 1b" : "=r" (loops) : "0" (loops) // 2 cycles
+    );
+}
+
+#else /* OWS_HOST */
+
+/* simulated: every call advances the clock by what the AVR code takes */
+void ows_pull_bus_down();
+void ows_release_bus();
+uint8_t ows_read_bus();
+void ows_hal_setup();
+void ows_hal_pcint_enable();
+void ows_hal_pcint_disable();
+void ows_hal_sleep();
+void ows_hal_timer_start();
+void ows_hal_timer_stop();
+uint8_t ows_hal_timer_read();
+void ows_hal_timer_clear();
+uint8_t ows_hal_timer_overflow();
+void ows_hal_timer_clear_flags();
+void ows_hal_timer_compare(uint8_t count);
+void ows_hal_timer_irq_enable();
+void ows_hal_timer_irq_disable();
+uint8_t ows_hal_eeprom_busy();
+void ows_hal_eeprom_write(uint16_t addr, uint8_t data);
+void ows_hal_eeprom_irq_enable();
+void ows_hal_eeprom_irq_disable();
+void ows_hal_delay4(uint16_t loops);
+void ows_hal_delay3(uint8_t loops);
+
+#endif /* OWS_HOST */
+
+#endif /* OWS_HAL_H_INCLUDED */
+
+/*
+ vim: ts=4 sw=4 sts=4 et
+*/
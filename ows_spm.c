@@ -1,12 +1,18 @@
 #include "ows_spm.h"
 #include "ows.h"
 #include "ow_crc16.h"
+#include "ows_eeprom.h"
 #include <avr/io.h>
 #include <avr/boot.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
+#ifdef OWS_HOST
+# include "ows_host.h"
+#endif
 
-#define PGM_PAGE_SIZE 32
+#define PGM_PAGE_SIZE 32 /* a read or a buffer fill, the device's page is SPM_PAGESIZE */
+#define EE_PAGE_SIZE 8 /* fits the EEPROM queue, the bus isn't held up */
+#define SPM_CONFIRM 0x5A /* go ahead after a CRC */
 
 static void write_page(uint16_t addr)
 {
@@ -21,37 +27,103 @@ static void write_page(uint16_t addr)
 	SREG = sreg;
 }
 
+static void send_crc(ow_crc16_t *crc)
+{
+	uint16_t c = ow_crc16_get(crc);
+	ows_send(c >> 8);
+	ows_send(c & 0xFF);
+}
+
+static uint8_t recv_crc(ow_crc16_t *crc)
+{
+	uint8_t c = ows_recv();
+	ow_crc16_update(crc, c);
+	return c;
+}
+
+/*
+ * 0x55: n pages of SPM_PAGESIZE in one request, from addr (page aligned).
+ * After each page the running CRC16 of everything so far, command and
+ * address included; the page is programmed when the master answers
+ * SPM_CONFIRM. Programming halts the CPU (9mS on ATTiny), the master
+ * waits that long before the next page. Any other answer or a reset ends
+ * the request with the pages before programmed.
+ */
+static void write_pages(uint16_t addr, ow_crc16_t *crc)
+{
+	uint8_t n = recv_crc(crc);
+	while(n-- && !errno) {
+		for(uint8_t i = 0; i < SPM_PAGESIZE; i += 2) {
+			uint16_t w = recv_crc(crc);
+			w |= recv_crc(crc) << 8;
+			boot_page_fill(addr + i, w);
+		}
+		send_crc(crc);
+		if(ows_recv() != SPM_CONFIRM || errno)
+			return;
+		write_page(addr);
+		addr += SPM_PAGESIZE;
+	}
+}
+
+/*
+ * 0x39: the CRC16 of each of n SPM_PAGESIZE pages from addr, for the master
+ * to skip the pages a new image leaves unchanged. Summing up a page takes
+ * longer than a time slot, so each CRC follows a 00 byte whenever it is
+ * ready: the master reads bits until the first 0, then the other 7, and
+ * is in step with the bytes again. Last the CRC16 of the request (command,
+ * address and n, as for 0x55) and the page CRCs.
+ */
+static void page_crcs(uint16_t addr, ow_crc16_t *crc)
+{
+	uint8_t n = recv_crc(crc);
+	while(n-- && !errno) {
+		ow_crc16_t page;
+		uint16_t c;
+		ow_crc16_reset(&page);
+		for(uint8_t i = 0; i < SPM_PAGESIZE; ++i)
+			ow_crc16_update(&page, pgm_read_byte_near(addr++));
+		c = ow_crc16_get(&page);
+		ows_send(0);
+		ows_send(c >> 8);
+		ow_crc16_update(crc, c >> 8);
+		ows_send(c & 0xFF);
+		ow_crc16_update(crc, c & 0xFF);
+	}
+	send_crc(crc);
+}
+
 void ows_spm()
 {
+	ow_crc16_t crc;
 	uint8_t cmd = ows_recv();
 	uint16_t addr = ows_recv() << 8;
 	addr |= ows_recv();
+	if(errno) /* never act on a broken request */
+		return;
+	ow_crc16_reset(&crc);
 	switch(cmd) {
 	case 0x33: /* read program memory page */
-		ow_crc16_reset();
 		for(uint8_t i = 0; i < PGM_PAGE_SIZE; ++i) {
 			uint8_t c = pgm_read_byte_near(addr++);
 			ows_send(c);
-			ow_crc16_update(c);
+			ow_crc16_update(&crc, c);
 		}
-		addr = ow_crc16_get();
-		ows_send(addr >> 8);
-		ows_send(addr & 0xFF);
+		send_crc(&crc);
+		break;
+	case 0x39: /* crc16 of program memory pages */
+		ow_crc16_update(&crc, cmd);
+		ow_crc16_update(&crc, addr >> 8);
+		ow_crc16_update(&crc, addr & 0xFF);
+		page_crcs(addr & ~(SPM_PAGESIZE - 1), &crc);
 		break;
 	case 0x3C: /* fill program memory page write buffer, return crc */
-		ow_crc16_reset();
 		for(uint8_t i = 0; i < PGM_PAGE_SIZE; i += 2) {
-			uint16_t w;
-			uint8_t c = ows_recv();
-			ow_crc16_update(c);
-			w = c << 8;
-			c = ows_recv();
-			w |= c;
+			uint16_t w = recv_crc(&crc) << 8; /* high byte first, only it in the crc */
+			w |= ows_recv();
 			boot_page_fill(addr + i, w);
 		}
-		addr = ow_crc16_get();
-		ows_send(addr >> 8);
-		ows_send(addr & 0xFF);
+		send_crc(&crc);
 		break;
 	case 0x5A: /* write page buffer */
 		write_page(addr);
@@ -59,14 +131,58 @@ void ows_spm()
 		ows_send(0);
 		ows_send(0);
 		break;
+	case 0x55: /* stream pages */
+		ow_crc16_update(&crc, cmd);
+		ow_crc16_update(&crc, addr >> 8);
+		ow_crc16_update(&crc, addr & 0xFF);
+		write_pages(addr, &crc);
+		break;
 	case 0xA5: /* read eeprom page */
+		for(uint8_t i = 0; i < EE_PAGE_SIZE; ++i) {
+			uint8_t c;
+			ows_eeprom_read(&c, addr++, 1);
+			ows_send(c);
+			ow_crc16_update(&crc, c);
+		}
+		send_crc(&crc);
 		break;
-	case 0xAA: /* write eeprom page */
+	case 0xAA: /* write eeprom page: data, crc back, written on SPM_CONFIRM */
+		if(addr > E2END + 1 - EE_PAGE_SIZE
+#ifdef OWS_WEAR_LEVEL_ENABLE
+				|| (addr + EE_PAGE_SIZE > OWS_ROM_STORE_BASE && addr < OWS_APP_STORE_BASE)
+#endif
+				)
+			break; /* the crc reads FF FF, nothing written */
+		{
+			uint8_t buf[EE_PAGE_SIZE];
+			for(uint8_t i = 0; i < EE_PAGE_SIZE; ++i)
+				buf[i] = recv_crc(&crc);
+			send_crc(&crc);
+			if(ows_recv() != SPM_CONFIRM || errno)
+				break;
+			ows_eeprom_write(addr, buf, EE_PAGE_SIZE); /* see ows_spm.h for when it's done */
+		}
 		break;
 	case 0xC3: /* jump to address */
+		cli();
+#ifdef OWS_HOST
+		ows_host_jump(addr);
+#else
+		((void (*)(void))(addr >> 1))(); /* a word address */
+#endif
 		break;
 	case 0xCC: /* read device id and page size */
+		{
+			uint8_t id[] = {
+				SIGNATURE_0, SIGNATURE_1, SIGNATURE_2,
+				SPM_PAGESIZE, FLASHEND >> 8, FLASHEND & 0xFF, E2END >> 8, E2END & 0xFF,
+			};
+			for(uint8_t i = 0; i < sizeof(id); ++i) {
+				ows_send(id[i]);
+				ow_crc16_update(&crc, id[i]);
+			}
+			send_crc(&crc);
+		}
 		break;
 	}
 }
-
@@ -1,6 +1,34 @@
 #ifndef OWS_SPM_H_INCLUDED
 #define OWS_SPM_H_INCLUDED
 
+/*
+ * Self programming over the bus, called by the device on its function
+ * command (0xDA in ds2413ex.c and boot.c). Then a command, an address (high
+ * byte first) and its data; CRC16s go high byte first.
+ *   33 addr                 -> 32 bytes of flash, crc
+ *   39 addr n               -> n times {00 when ready, crc of the page},
+ *                              crc (from 39 addr n on); n SPM pages, see
+ *                              page_crcs()
+ *   3C addr <16 words>      -> crc; fills the page buffer, each word high
+ *                              byte first and only the high bytes in the
+ *                              crc, as it always was (55 takes the bytes
+ *                              as in flash and sums up all of them)
+ *   5A addr                 -> programs the buffer into the page, 00 00 00
+ *   55 addr n {<page> -> crc, 5A}...
+ *                           n whole pages streamed, see write_pages()
+ *   A5 addr                 -> 8 bytes of EEPROM, crc
+ *   AA addr <8 bytes>       -> crc, then 5A queues them; not past E2END nor
+ *                              into the ROM ID store (OWS_WEAR_LEVEL_ENABLE),
+ *                              the crc reads FFFF then. EEPROM STATUS (D6)
+ *                              tells when they're written; built without
+ *                              OWS_WRITE_ROM_ENABLE (boot.c) the master
+ *                              waits 8 x 3.4mS before the next A5 or AA.
+ *                              Without OWS_EEPROM_QUEUE_ENABLE the device
+ *                              is deaf that long after 5A
+ *   C3 addr                 jumps to the byte address, e.g. 0 restarts
+ *   CC 0000                 -> signature[3], page size, FLASHEND:2,
+ *                              E2END:2, crc
+ */
 void ows_spm();
 
 #endif /* OWS_SPM_H_INCLUDED */
@@ -0,0 +1,404 @@
+#include <avr/io.h>
+#include "ows.h"
+#include "sniff_hal.h"
+#include <avr/interrupt.h>
+#include <wdt.h>
+
+/*
+ * Passive bus sniffer for an ATMega168 on the bus pin of ows.h (D7), which
+ * it only ever reads. The pin change interrupt timestamps every edge from
+ * timer 1 (clk/8, 0.5uS a tick at 16MHz) into a ring, the main loop
+ * decodes resets, presence pulses, bits, bytes and ROM commands from it and
+ * streams records to the PC at 1Mbaud, 8N1. A bit slot at standard speed
+ * takes 60uS, the interrupt about 4; a low pulse shorter than that comes
+ * out as two edges at the same time, which still decodes as a 1.
+ *
+ * Overdrive slots are too short for the interrupt and the decoder to keep
+ * up with, so once a ROM command switches the bus to overdrive the edges
+ * are polled with interrupts off into a buffer instead, a burst at a time:
+ * from the next edge until the bus stays quiet for 100uS, low included (the
+ * interrupt then takes the rising edge of a reset). The burst is decoded
+ * and streamed, then the next one is captured, until a reset at standard
+ * speed. What doesn't fit the buffer (256 pulses, 32 bytes), and
+ * overdrive bits the interrupt sees while a burst is being streamed, are
+ * reported lost. 'C' from the PC captures bursts at standard speed too,
+ * 'L' goes back to the interrupt.
+ *
+ * Records: a header byte, the type in the high nibble and the length of
+ * what follows in the low one, then little endian fields. Times in ticks.
+ *   1 RESET     t:4 low:2   falling edge and low time
+ *   2 PRESENCE  low:2
+ *   3 ROM       cmd [rom:8] the ROM read, matched or searched for
+ *   4 DATA      byte        what the bus carried, read or written
+ *   5 BITS      n bits      a partial byte cut off by a reset
+ *   6 LOST      n           edges missed or not decoded, the decoder
+ *                           ignores the bus until the next reset
+ *   7 CAPTURE   n:2         a burst of n edges, its records follow
+ */
+#define SNIFF_BAUD 1000000L
+#define TICKS(us) ((uint16_t)((us) * (CLK_FREQ / 1000) / 8))
+
+enum sniff_record {
+	REC_RESET = 0x10,
+	REC_PRESENCE = 0x20,
+	REC_ROM = 0x30,
+	REC_DATA = 0x40,
+	REC_BITS = 0x50,
+	REC_LOST = 0x60,
+	REC_CAPTURE = 0x70,
+};
+
+/* to the PC, polled from the main loop */
+#define TX_LEN 64 /* power of 2 */
+static uint8_t tx_buf[TX_LEN], tx_head, tx_tail;
+
+static void tx_pump()
+{
+	if(tx_head != tx_tail && sniff_hal_uart_ready()) {
+		sniff_hal_uart_write(tx_buf[tx_head]);
+		tx_head = (tx_head + 1) & (TX_LEN - 1);
+	}
+}
+
+static void tx_put(uint8_t c)
+{
+	uint8_t next = (tx_tail + 1) & (TX_LEN - 1);
+	while(next == tx_head)
+		tx_pump();
+	tx_buf[tx_tail] = c;
+	tx_tail = next;
+}
+
+static void record(uint8_t type, const void *data, uint8_t len)
+{
+	const uint8_t *p = data;
+	tx_put(type | len);
+	while(len--)
+		tx_put(*p++);
+}
+
+/*
+ * Edges, written by the interrupts. An entry carries the timer overflows
+ * since the one before, so the decoder knows the time beyond 16 bits; the
+ * overflow interrupt adds an entry of its own before the count saturates.
+ */
+#define EDGE_LEN 32 /* power of 2, 16 pulses */
+#define EDGE_HIGH 0x01 /* the level after the edge */
+#define EDGE_LOST 0x02 /* edges were dropped before this one */
+#define EDGE_NONE 0x04 /* no edge, only the overflows */
+static struct edge {
+	uint16_t t;
+	uint8_t wraps;
+	uint8_t flags;
+} edges[EDGE_LEN];
+static volatile uint8_t edge_head, edge_tail;
+static volatile uint8_t edges_lost;
+static uint8_t edge_level = 1, edge_wraps, edge_flags; /* the interrupts' own */
+
+/* interrupts off; 0 if the ring is full */
+static uint8_t edge_put(uint16_t t, uint8_t flags)
+{
+	uint8_t next = (edge_tail + 1) & (EDGE_LEN - 1);
+	if(next == edge_head)
+		return 0;
+	edges[edge_tail].t = t;
+	edges[edge_tail].wraps = edge_wraps;
+	edges[edge_tail].flags = flags | edge_flags;
+	edge_wraps = 0;
+	edge_flags = 0;
+	edge_tail = next;
+	return 1;
+}
+
+static void edge_add(uint16_t t, uint8_t high)
+{
+	if(!edge_put(t, high ? EDGE_HIGH : 0)) {
+		edge_flags = EDGE_LOST;
+		if(edges_lost != 0xFF)
+			++edges_lost;
+	}
+}
+
+/* the overflow came before t was read but hasn't been served yet */
+static void edge_overflow_check(uint16_t t)
+{
+	if(sniff_hal_timer_overflow() && !(t & 0x8000)) {
+		sniff_hal_timer_clear_overflow();
+		++edge_wraps;
+	}
+}
+
+ISR(OWPCINT_vect)
+{
+	uint16_t t = sniff_hal_timer_read();
+	uint8_t b = ows_read_bus();
+	edge_overflow_check(t);
+	if(b == edge_level) {
+		/* a pulse shorter than the latency, its second edge set the flag again */
+		sniff_hal_pcint_clear();
+		edge_add(t, !b);
+	}
+	edge_add(t, b);
+	edge_level = b;
+}
+
+ISR(TIMER1_OVF_vect)
+{
+	if(++edge_wraps == 0xFF && !edge_put(0, EDGE_NONE))
+		edge_wraps = 0xFE; /* the decoder is stuck anyway */
+}
+
+/* decoder */
+enum sniff_state {
+	SNIFF_IDLE,     /* until the next reset */
+	SNIFF_PRESENCE, /* the first pulse after a reset */
+	SNIFF_ROM,      /* the ROM command */
+	SNIFF_ROM_ID,   /* 64 bits of READ ROM or MATCH ROM */
+	SNIFF_SEARCH,   /* id bit, complement, direction, 64 times */
+	SNIFF_DATA,
+};
+static uint8_t state, od, forced;
+static uint8_t live; /* the edge came through the interrupt */
+static uint8_t skipped; /* overdrive edges the interrupt saw, since the last reset */
+static uint8_t byte, nbits, rom_bit, triplet;
+static uint8_t rom_cmd[9]; /* the ROM command and the ROM */
+static uint16_t clock_hi; /* the timer beyond 16 bits */
+static uint32_t fall_at, reset_end;
+static uint8_t fall_seen;
+
+static void sniff_flush()
+{
+	if(nbits && (state == SNIFF_ROM || state == SNIFF_DATA)) {
+		uint8_t r[2] = { nbits, byte >> (8 - nbits) };
+		record(REC_BITS, r, 2);
+	}
+	nbits = 0;
+}
+
+static void sniff_lost(uint8_t n)
+{
+	if(n)
+		record(REC_LOST, &n, 1);
+	sniff_flush();
+	state = SNIFF_IDLE;
+}
+
+static void sniff_rom_command(uint8_t c)
+{
+	rom_cmd[0] = c;
+	for(uint8_t i = 1; i < 9; ++i)
+		rom_cmd[i] = 0;
+	rom_bit = 0;
+	triplet = 0;
+	switch(c) {
+	case 0x69: /* OVERDRIVE MATCH ROM, the ROM at overdrive already */
+		od = 1;
+		/* fall through */
+	case 0x33: /* READ ROM */
+	case 0x55: /* MATCH ROM */
+		state = SNIFF_ROM_ID;
+		return;
+	case 0xF0: /* SEARCH ROM */
+	case 0xEC: /* ALARM SEARCH */
+		state = SNIFF_SEARCH;
+		return;
+	case 0x3C: /* OVERDRIVE SKIP ROM */
+		od = 1;
+		break;
+	}
+	record(REC_ROM, rom_cmd, 1);
+	state = SNIFF_DATA;
+}
+
+static void sniff_bit(uint8_t b)
+{
+	switch(state) {
+	case SNIFF_SEARCH:
+		if(++triplet < 3)
+			return; /* the id bit and its complement, read */
+		triplet = 0;
+		/* fall through: the direction written is the ROM bit */
+	case SNIFF_ROM_ID:
+		if(b)
+			rom_cmd[1 + (rom_bit >> 3)] |= 1 << (rom_bit & 7);
+		if(++rom_bit == 64) {
+			record(REC_ROM, rom_cmd, 9);
+			state = SNIFF_DATA;
+		}
+		break;
+	case SNIFF_ROM:
+	case SNIFF_DATA:
+		byte = (byte >> 1) | (b << 7);
+		if(++nbits < 8)
+			break;
+		nbits = 0;
+		if(state == SNIFF_ROM)
+			sniff_rom_command(byte);
+		else
+			record(REC_DATA, &byte, 1);
+		break;
+	}
+}
+
+/* an edge at t ticks, high if the bus rose */
+static void sniff_edge(uint32_t t, uint8_t high)
+{
+	uint32_t low;
+	uint16_t low16;
+	if(!high) {
+		fall_at = t;
+		fall_seen = 1;
+		return;
+	}
+	if(!fall_seen)
+		return;
+	low = t - fall_at;
+	low16 = low > 0xFFFF ? 0xFFFF : low;
+	if(low >= TICKS(400) || (od && low >= TICKS(48))) {
+		struct { uint32_t t; uint16_t low; } r = { fall_at, low16 };
+		if(skipped) {
+			sniff_lost(skipped);
+			skipped = 0;
+		}
+		sniff_flush();
+		if(low >= TICKS(400))
+			od = 0;
+		record(REC_RESET, &r, 6);
+		state = SNIFF_PRESENCE;
+		reset_end = t;
+		return;
+	}
+	if(state == SNIFF_PRESENCE) {
+		state = SNIFF_ROM;
+		/* 15-60uS after the reset, 60-240uS long (overdrive: 2-6, 8-24) */
+		if(fall_at - reset_end < (od ? TICKS(10) : TICKS(75))
+				&& low >= (od ? TICKS(6) : TICKS(45))) {
+			record(REC_PRESENCE, &low16, 2);
+			return;
+		}
+	}
+	if(live && od) { /* a read 0 may look like a 1 by now */
+		skipped = skipped > 0xFD ? 0xFF : skipped + 2;
+		sniff_lost(0);
+		return;
+	}
+	sniff_bit(low < (od ? TICKS(2) : TICKS(15)));
+}
+
+static void sniff_take()
+{
+	struct edge e = edges[edge_head];
+	edge_head = (edge_head + 1) & (EDGE_LEN - 1);
+	clock_hi += e.wraps;
+	if(e.flags & EDGE_NONE)
+		return;
+	if(e.flags & EDGE_LOST) {
+		uint8_t n;
+		cli();
+		n = edges_lost;
+		edges_lost = 0;
+		sei();
+		sniff_lost(n);
+		fall_seen = 0;
+	}
+	live = 1;
+	sniff_edge((uint32_t)clock_hi << 16 | e.t, e.flags & EDGE_HIGH);
+}
+
+/*
+ * A burst with interrupts off: the low byte of the timer at every edge,
+ * the quiet time that ends it keeps the gaps below 256 ticks. Once the
+ * buffer is full the edges are only counted. Called with the ring empty,
+ * the overflows it missed become the ring's again.
+ */
+#define CAPTURE_LEN 512
+#define CAPTURE_QUIET TICKS(100)
+static uint8_t capture[CAPTURE_LEN];
+
+static void sniff_capture()
+{
+	uint16_t n = 1, t0;
+	uint8_t level, first, prev, t, over = 0;
+	uint32_t at;
+	cli();
+	level = ows_read_bus();
+	/* the first edge, as long as it takes unless the PC has something to say */
+	while(ows_read_bus() == level) {
+		if(sniff_hal_timer_overflow()) {
+			sniff_hal_timer_clear_overflow();
+			++edge_wraps;
+		}
+		if(sniff_hal_uart_received()) {
+			sei();
+			return;
+		}
+	}
+	t0 = sniff_hal_timer_read();
+	edge_overflow_check(t0);
+	clock_hi += edge_wraps;
+	edge_wraps = 0;
+	at = (uint32_t)clock_hi << 16 | t0;
+	first = level = !level;
+	capture[0] = prev = t0;
+	for(;;) {
+		t = sniff_hal_timer_read8();
+		if(ows_read_bus() != level) {
+			if(n < CAPTURE_LEN)
+				capture[n++] = t;
+			else if(over != 0xFF)
+				++over;
+			prev = t;
+			level = !level;
+		} else if((uint8_t)(t - prev) > CAPTURE_QUIET)
+			break;
+	}
+	/* an edge after the last poll: the interrupt sees the ones after this */
+	sniff_hal_pcint_clear();
+	if(ows_read_bus() != level) {
+		level = !level;
+		if(n < CAPTURE_LEN)
+			capture[n++] = sniff_hal_timer_read8();
+		else if(over != 0xFF)
+			++over;
+	}
+	edge_level = level;
+	sei();
+
+	record(REC_CAPTURE, &n, 2);
+	live = 0;
+	sniff_edge(at, first);
+	for(uint16_t i = 1; i < n; ++i) {
+		at += (uint8_t)(capture[i] - capture[i - 1]);
+		first = !first;
+		sniff_edge(at, first);
+	}
+	if(over) {
+		sniff_lost(over);
+		fall_seen = 0;
+	}
+}
+
+int main()
+{
+	wdt_disable();
+	sniff_hal_uart_setup(CLK_FREQ * 1000L / 8 / SNIFF_BAUD - 1);
+	sniff_hal_timer_start();
+	ows_hal_setup();
+	edge_level = ows_read_bus();
+	ows_hal_pcint_enable();
+	sei();
+	for(;;) {
+		if(edge_head != edge_tail)
+			sniff_take();
+		else if((od || forced) && tx_head == tx_tail)
+			sniff_capture();
+		if(sniff_hal_uart_received()) {
+			uint8_t c = sniff_hal_uart_read();
+			if(c == 'C')
+				forced = 1;
+			else if(c == 'L')
+				forced = 0;
+		}
+		tx_pump();
+	}
+}
@@ -0,0 +1,105 @@
+#ifndef SNIFF_HAL_H_INCLUDED
+#define SNIFF_HAL_H_INCLUDED
+
+/*
+ * What the bus sniffer needs on top of ows_hal.h (bus pin, pin change
+ * interrupt): timer 1 as the time base and USART0 towards the PC, polled.
+ * ATMega168 only, the pin change flag is that of port D. With OWS_HOST the
+ * functions live in host/sniff_host.c.
+ */
+
+#include "ows_hal.h"
+
+#ifndef OWS_HOST
+
+/* 8N1, double speed (ubrr = clk / 8 / baud - 1), no interrupts */
+static inline void sniff_hal_uart_setup(uint16_t ubrr)
+{
+    PRR &= ~(1 << PRUSART0);
+    UBRR0H = (unsigned char)(ubrr >> 8);
+    UBRR0L = (unsigned char)ubrr;
+    UCSR0A = 1<<U2X0;
+    UCSR0B = (1<<RXEN0)|(1<<TXEN0);
+    UCSR0C = (3<<UCSZ00);
+}
+
+/* UDR0 takes the next byte */
+static inline uint8_t sniff_hal_uart_ready()
+{
+    return UCSR0A & (1<<UDRE0);
+}
+
+static inline void sniff_hal_uart_write(uint8_t c)
+{
+    UDR0 = c;
+}
+
+static inline uint8_t sniff_hal_uart_received()
+{
+    return UCSR0A & (1<<RXC0);
+}
+
+static inline uint8_t sniff_hal_uart_read()
+{
+    return UDR0;
+}
+
+/* timer 1: normal mode, clk/8 (0.5uS at 16MHz), overflow interrupt on */
+static inline void sniff_hal_timer_start()
+{
+    PRR &= ~(1 << PRTIM1);
+    TCCR1A = 0;
+    TCCR1B = 1<<CS11;
+    TIFR1 = 1<<TOV1;
+    TIMSK1 = 1<<TOIE1;
+}
+
+static inline uint16_t sniff_hal_timer_read()
+{
+    return TCNT1;
+}
+
+/* the low byte alone, one instruction less in the capture loop */
+static inline uint8_t sniff_hal_timer_read8()
+{
+    return TCNT1L;
+}
+
+/* an overflow TIMER1_OVF_vect hasn't served yet */
+static inline uint8_t sniff_hal_timer_overflow()
+{
+    return TIFR1 & (1<<TOV1);
+}
+
+static inline void sniff_hal_timer_clear_overflow()
+{
+    TIFR1 = 1<<TOV1;
+}
+
+/* forget the bus edges seen since the pin change interrupt was entered */
+static inline void sniff_hal_pcint_clear()
+{
+    PCIFR = 1<<PCIF2;
+}
+
+#else /* OWS_HOST */
+
+void sniff_hal_uart_setup(uint16_t ubrr);
+uint8_t sniff_hal_uart_ready();
+void sniff_hal_uart_write(uint8_t c);
+uint8_t sniff_hal_uart_received();
+uint8_t sniff_hal_uart_read();
+void sniff_hal_timer_start();
+uint16_t sniff_hal_timer_read();
+uint8_t sniff_hal_timer_read8();
+uint8_t sniff_hal_timer_overflow();
+void sniff_hal_timer_clear_overflow();
+void sniff_hal_pcint_clear();
+
+#endif /* OWS_HOST */
+
+#endif /* SNIFF_HAL_H_INCLUDED */
+
+/*
+ vim: ts=4 sw=4 sts=4 et
+*/